@@ -0,0 +1,28 @@
+#include "adaptive-scale.hpp"
+
+void AdaptiveScale::reset(uint32_t frameUs)
+{
+    this->frameUs = frameUs;
+    avgUs = 0;
+    frames = 0;
+    scale = 0;
+}
+
+void AdaptiveScale::addFrame(uint32_t decodeUs)
+{
+    // moving average over roughly the last 8 frames
+    avgUs = frames ? avgUs - avgUs / 8 + decodeUs / 8 : decodeUs;
+
+    if(++frames < minFrames || !frameUs)
+        return;
+
+    // decoding at a smaller scale isn't proportionally faster, so wait until there's plenty of time before going back up
+    if(avgUs > frameUs && scale < maxScale)
+        scale++;
+    else if(avgUs < frameUs / 2 && scale > 0)
+        scale--;
+    else
+        return;
+
+    frames = 0;
+}
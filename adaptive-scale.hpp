@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstdint>
+
+// picks a reduced decode scale when frames take longer to decode than they're shown for
+// and goes back up once there's enough time again
+class AdaptiveScale
+{
+public:
+    void reset(uint32_t frameUs);
+
+    // time taken to decode the last frame at the current scale
+    void addFrame(uint32_t decodeUs);
+
+    int getScale() const {return scale;}
+
+private:
+    static const int maxScale = 3;
+    static const int minFrames = 8; // at a scale before changing again
+
+    uint32_t frameUs = 0;
+    uint32_t avgUs = 0;
+    int frames = 0;
+    int scale = 0;
+};
@@ -0,0 +1,78 @@
+#include <cstdlib>
+#include <new>
+
+#include "alloc-counter.hpp"
+
+#ifdef ALLOC_COUNTER
+
+// per thread on desktop builds, frames are decoded on another thread there
+#ifdef HOST_BUILD
+static thread_local uint32_t allocCount = 0;
+#else
+static uint32_t allocCount = 0;
+#endif
+
+uint32_t getAllocCount()
+{
+    return allocCount;
+}
+
+static void *countedAlloc(size_t size)
+{
+    allocCount++;
+    return malloc(size ? size : 1);
+}
+
+static void *countedAllocOrFail(size_t size)
+{
+    if(auto ptr = countedAlloc(size))
+        return ptr;
+
+#ifdef __cpp_exceptions
+    throw std::bad_alloc();
+#else
+    abort();
+#endif
+}
+
+void *operator new(size_t size)
+{
+    return countedAllocOrFail(size);
+}
+
+void *operator new[](size_t size)
+{
+    return countedAllocOrFail(size);
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept
+{
+    return countedAlloc(size);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept
+{
+    return countedAlloc(size);
+}
+
+void operator delete(void *ptr) noexcept
+{
+    free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept
+{
+    free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+    free(ptr);
+}
+
+void operator delete[](void *ptr, size_t) noexcept
+{
+    free(ptr);
+}
+
+#endif
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+
+// counts heap allocations in debug builds, to check that playback doesn't allocate
+#ifndef NDEBUG
+#define ALLOC_COUNTER
+
+uint32_t getAllocCount();
+#endif
+
+// asserts that nothing is allocated while in scope
+class NoAllocScope
+{
+public:
+#ifdef ALLOC_COUNTER
+    NoAllocScope() : startCount(getAllocCount()) {}
+    ~NoAllocScope() {assert(getAllocCount() == startCount);}
+
+private:
+    uint32_t startCount;
+#else
+    // not trivial, so scopes don't warn as unused variables
+    NoAllocScope() {}
+    ~NoAllocScope() {}
+#endif
+};
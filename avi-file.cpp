@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cassert>
 #include <cinttypes>
 #include <cstring>
@@ -6,6 +7,7 @@
 #include "engine/engine.hpp"
 
 #include "avi-file.hpp"
+#include "alloc-counter.hpp"
 
 #define MINIMP3_IMPLEMENTATION
 #include "minimp3.h"
@@ -16,6 +18,7 @@
 extern blit::ProfilerProbe *profilerVidReadProbe;
 extern blit::ProfilerProbe *profilerVidDecProbe;
 extern blit::ProfilerProbe *profilerAudReadProbe;
+extern blit::ProfilerProbe *profilerIdxLoadProbe;
 #endif
 
 static Chunk readChunk(blit::File &file, uint32_t offset)
@@ -25,6 +28,18 @@ static Chunk readChunk(blit::File &file, uint32_t offset)
     return ret;
 }
 
+// decode_jpeg_buffer's allocator has no context, so point it at the current frame buffer
+static std::vector<uint8_t> *decodeFrameBuf = nullptr;
+
+static void *allocFrameBuffer(size_t size)
+{
+    // only grows if the frame is larger than the header says
+    if(decodeFrameBuf->size() < size)
+        decodeFrameBuf->resize(size);
+
+    return decodeFrameBuf->data();
+}
+
 static bool checkId(char *id, const char *exId)
 {
     if(memcmp(id, exId, 4) != 0)
@@ -38,16 +53,141 @@ static bool checkId(char *id, const char *exId)
 
 bool AVIFile::load(std::string filename)
 {
-    frameDataOffset = 0;
+    // also saves the last file's index
+    if(playing)
+        stop();
+
+    frameDataOffset = frameDataEnd = 0;
+    indexType = IndexType::None;
+    indexOffset = indexEnd = 0;
     playing = false;
     streams.clear();
     audioFormat = AudioFormat::None;
     currentSample = nullptr;
+    jpeg = {};
+    frameOnScreen = false;
+    frameRendered = bordersCleared = false;
+
+#ifdef HOST_BUILD
+    // the decode thread may still be using the decoder
+    framePipeline.flush();
+    videoQueued = false;
+#endif
+
+    jpegDecoder.reset();
 
     file.open(filename);
     if(!file.is_open())
         return false;
 
+    // try to skip parsing the headers and index
+    indexCacheFilename = filename + ".idx";
+    indexCached = loadIndexCache();
+
+    if(!indexCached)
+    {
+        streams.clear();
+
+        if(!parseFile())
+            return false;
+    }
+
+    if(!frameDataOffset)
+        return false;
+
+    readBuffer.init(file, readBufferSize, frameDataEnd);
+
+    setScreenMode();
+
+    // decode files bigger than the screen at a smaller scale
+    fitScale = 0;
+
+    while(fitScale <= 3)
+    {
+        int w = (mainHead.width + (1 << fitScale) - 1) >> fitScale;
+        int h = (mainHead.height + (1 << fitScale) - 1) >> fitScale;
+
+        if(w <= blit::screen.bounds.w && h <= blit::screen.bounds.h)
+            break;
+
+        fitScale++;
+    }
+
+    if(fitScale > 3)
+        printf("file size %" PRIu32 "x%" PRIu32 " is too big to scale down, cropping...\n", mainHead.width, mainHead.height);
+
+    // start cropped views in the middle
+    viewX = std::max(int(mainHead.width) - blit::screen.bounds.w, 0) / 2;
+    viewY = std::max(int(mainHead.height) - blit::screen.bounds.h, 0) / 2;
+
+    adaptiveScale.reset(mainHead.usPerFrame);
+
+#ifdef HOST_BUILD
+    framePipeline.start(blit::screen.bounds.w, blit::screen.bounds.h, mainHead.usPerFrame);
+#endif
+
+    updateView();
+
+    // allocate chunk buffers up front
+    for(auto &stream : streams)
+    {
+        // the file's suggested size is for the biggest chunk of any stream, only use it if the stream doesn't have one
+        auto bufSize = stream.suggestedBufferSize ? stream.suggestedBufferSize : mainHead.suggestedBufferSize;
+        bufSize = std::min(bufSize, maxSuggestedBufferSize);
+
+        if(stream.type == StreamType::Video && videoChunkBuf.size() < bufSize)
+            videoChunkBuf.resize(bufSize);
+        else if(stream.type == StreamType::Audio && audioFormat == AudioFormat::MP3 && audioChunkBuf.size() < bufSize)
+            audioChunkBuf.resize(bufSize);
+    }
+
+    // find the first chunk of every stream
+    for(auto &stream : streams)
+    {
+        if(indexType == IndexType::None)
+        {
+            // no index, scan the stream data
+            if(!findStreamChunk(stream, frameDataOffset + 4))
+                stream.ended = true;
+
+            continue;
+        }
+        else if(indexType == IndexType::OpenDML)
+        {
+            stream.subIndexCache.reserve(subIndexCacheEntries * 2);
+
+            if(stream.superIndex.empty() || !openSubIndex(stream) || !loadSubIndexEntry(stream))
+                stream.ended = true;
+
+            continue;
+        }
+
+        while(stream.frameOffsets.empty() && indexOffset < indexEnd)
+            parseIndex(idxBlockEntries);
+
+        if(!stream.frameOffsets.empty())
+        {
+            stream.curOffset = frameDataOffset;
+            stream.frameOffsets.readNext(stream.indexPos, stream.curOffset, stream.curSize);
+        }
+        else
+            stream.ended = true;
+    }
+
+    if(audioFormat != AudioFormat::None)
+    {
+        for(int i = 0; i < numAudioBufs; i++)
+            dataSize[i] = 0;
+
+        if(audioFormat == AudioFormat::MP3)
+            mp3dec_init(&mp3dec);
+    }
+
+    return true;
+}
+
+bool AVIFile::parseFile()
+{
     auto headChunk = readChunk(file, 0);
 
     if(!checkId(headChunk.id, "RIFF"))
@@ -59,9 +199,16 @@ bool AVIFile::load(std::string filename)
     if(!checkId(buf, "AVI "))
         return false;
 
+    // don't trust the header if the file was truncated, or the size was never written
+    auto fileLen = file.get_length();
+    if(fileLen < 12)
+        return false;
+
+    auto riffEnd = headChunk.len == 0 || headChunk.len > fileLen - 8 ? fileLen : headChunk.len + 8;
+
     uint32_t offset = 12;
 
-    while(offset < headChunk.len - 12)
+    while(offset + 8 <= riffEnd)
     {
         auto chunk = readChunk(file, offset);
         std::string idStr(chunk.id, 4);
@@ -74,63 +221,51 @@ bool AVIFile::load(std::string filename)
             {
                 if(!parseHeaders(offset + 12, chunk.len - 12))
                     return false;
+
+                // prefer OpenDML indices if there are any
+                for(auto &stream : streams)
+                {
+                    if(!stream.superIndex.empty())
+                        indexType = IndexType::OpenDML;
+                }
             }
             else if(listIdStr == "movi")
             {
-                // stream data
+                // stream data, runs to the end of the file if the recording wasn't finished
+                if(chunk.len == 0)
+                    chunk.len = fileLen - offset - 8;
+
                 frameDataOffset = offset + 8;
+                frameDataEnd = chunk.len > fileLen - offset - 8 ? fileLen : offset + 8 + chunk.len;
+
+                // OpenDML data continues in more RIFFs
+                if(indexType == IndexType::OpenDML)
+                    frameDataEnd = fileLen;
             }
         }
-        else if(idStr == "idx1")
+        else if(idStr == "idx1" && indexType == IndexType::None)
         {
             // reserve vectors
             for(auto &stream : streams)
                 stream.frameOffsets.reserve(stream.length);
 
-            std::vector<uint32_t> streamOffsets;
-            streamOffsets.resize(streams.size());
-
-            uint32_t idxOff = offset + 8;
-            auto end = offset + 8 + chunk.len;
-            while(idxOff < end)
-            {
-                uint32_t data[3]; // flags,offset, size
-                file.read(idxOff, 4, buf);
-                file.read(idxOff + 4, 12, reinterpret_cast<char *>(data));
-
-                int streamNum = (buf[0] - '0') * 10 + (buf[1] - '0');
-
-                auto &frameOffsets = streams[streamNum].frameOffsets;
-
-                auto relOff = data[1] - streamOffsets[streamNum];
-                assert((relOff & 1) == 0); // aligned
-                assert(relOff < 0x20000);
-                frameOffsets.push_back(relOff / 2);
-
-                streamOffsets[streamNum] = data[1];
-
-                idxOff += 16;
-            }
-
-            for(auto &stream : streams)
-                stream.curOffset = frameDataOffset + stream.frameOffsets[0] * 2;
+            // only parse the start of the index here, the rest is loaded during playback
+            indexType = IndexType::Legacy;
+            indexOffset = offset + 8;
+            indexEnd = chunk.len > fileLen - offset - 8 ? fileLen : offset + 8 + chunk.len;
+            parseIndex(initialIndexEntries);
         }
 
+        // truncated (or a broken length), nothing after this
+        if(chunk.len > riffEnd - offset - 8)
+            break;
+
         offset += 8 + chunk.len;
         if(chunk.len & 1)
             offset++;
     }
 
-    if(audioFormat != AudioFormat::None)
-    {
-        for(int i = 0; i < numAudioBufs; i++)
-            dataSize[i] = 0;
-
-        if(audioFormat == AudioFormat::MP3)
-            mp3dec_init(&mp3dec);
-    }
-
-    return frameDataOffset != 0;
+    return true;
 }
 
 void AVIFile::play(int audioChannel)
@@ -143,6 +278,16 @@ void AVIFile::play(int audioChannel)
     playing = true;
     decodedFirstFrame = false;
     bufferedSamples = 0;
+    lastFrameLen = 0;
+
+    // the screen was used for something else
+    frameRendered = bordersCleared = false;
+
+#ifdef HOST_BUILD
+    // start again from the current chunk
+    framePipeline.flush();
+    videoQueued = false;
+#endif
 
     update(startTime); // decode first frame
 
@@ -158,6 +303,14 @@ void AVIFile::stop()
 {
     playing = false;
 
+    // writing the whole index would stall playback, so wait until now
+    if(indexType == IndexType::Legacy && !indexCached && indexOffset >= indexEnd)
+        saveIndexCache();
+
+#ifdef HOST_BUILD
+    framePipeline.flush();
+#endif
+
     if(channel != -1 && audioFormat != AudioFormat::None)
     {
         blit::channels[0].off();
@@ -165,6 +318,58 @@ void AVIFile::stop()
     }
 }
 
+void AVIFile::setCropped(bool cropped)
+{
+    if(cropped == this->cropped)
+        return;
+
+    this->cropped = cropped;
+
+    if(file.is_open())
+        updateView();
+}
+
+void AVIFile::setPaletted(bool paletted)
+{
+    if(paletted == this->paletted)
+        return;
+
+    this->paletted = paletted;
+
+    if(!file.is_open())
+        return;
+
+#ifdef HOST_BUILD
+    // the decode thread may still be using the decoder
+    framePipeline.flush();
+    videoQueued = false;
+#else
+    // finish drawing the current frame before the screen format changes under it
+    while(jpegDecoder.isDecoding())
+        jpegDecoder.decodeStep(decodeStepRows);
+#endif
+
+    setScreenMode();
+    updateView();
+
+    // decode the current frame again in the new format
+    decodedFirstFrame = false;
+    frameOnScreen = false;
+    frameRendered = bordersCleared = false;
+}
+
+void AVIFile::pan(int dx, int dy)
+{
+    int maxX = std::max(int(mainHead.width) - blit::screen.bounds.w, 0);
+    int maxY = std::max(int(mainHead.height) - blit::screen.bounds.h, 0);
+
+    viewX = std::min(std::max(viewX + dx, 0), maxX);
+    viewY = std::min(std::max(viewY + dy, 0), maxY);
+
+    if(file.is_open() && (cropped || fitScale > 3) && (frameX != viewX || frameY != viewY))
+        updateView();
+}
+
 void AVIFile::update(uint32_t time)
 {
     if(!file.is_open() || !playing)
@@ -173,18 +378,38 @@ void AVIFile::update(uint32_t time)
     if(time < startTime)
         return; // time-travel!
 
+    // keep loading the index a little at a time, it's cached when playback stops
+    if(indexOffset < indexEnd)
+        parseIndex(idxBlockEntries);
+
     // use audio playback as timer if possible
     if(audioFormat != AudioFormat::None)
         time = (uint64_t(bufferedSamples + blit::channels[channel].wave_buf_pos) * 1000) / 22050;
     else
         time -= startTime;
 
+#ifdef HOST_BUILD
+    videoTime = time;
+#endif
+
     for(auto &stream : streams)
     {
+#ifdef HOST_BUILD
+        if(stream.type == StreamType::Video)
+        {
+            queueVideoFrames(stream, time);
+            continue;
+        }
+#endif
+
         if(stream.type == StreamType::Video)
         {
-            if(stream.curFrame + 1 == stream.length)
+            // finish the current frame before moving on
+            if(jpegDecoder.isDecoding())
+            {
+                continueFrameDecode();
                 continue;
+            }
 
             auto nextFrameTime = ((stream.curFrame + 1) * mainHead.usPerFrame) / 1000;
 
@@ -193,41 +418,85 @@ void AVIFile::update(uint32_t time)
                 continue;
 
             // skip frames
-            while(nextFrameTime <= time && stream.curFrame < stream.length)
+            bool newFrame = !decodedFirstFrame;
+            while(nextFrameTime <= time && nextFrame(stream))
             {
-                nextFrame(stream);
+                newFrame = true;
                 nextFrameTime = ((stream.curFrame + 1) * mainHead.usPerFrame) / 1000;
             }
 
-            auto chunk = readChunk(file, stream.curOffset);
+            // end of stream
+            if(!newFrame)
+                continue;
+
+            auto len = stream.curSize;
 
-            if(chunk.len == 0)
+            if(len == 0 || len > maxChunkSize)
                 continue;
 
-            auto buf = new uint8_t[chunk.len];
+            // only grows if the suggested size was wrong
+            if(videoChunkBuf.size() < len)
+                videoChunkBuf.resize(len);
+
+            auto buf = videoChunkBuf.data();
 
 #ifdef PROFILER
             profilerVidReadProbe->start();
 #endif
-            file.read(stream.curOffset + 8, chunk.len, (char *)buf);
+            {
+                NoAllocScope noAlloc;
+                readBuffer.read(stream.curOffset + 8, len, (char *)buf);
+            }
 
 #ifdef PROFILER
             profilerVidReadProbe->store_elapsed_us();
 #endif
 
+            // the last frame is still on the screen
+            if(isDuplicateFrame(buf, len) && decodedFirstFrame)
+                continue;
+
+            // decode straight into the screen, centred
+            auto &screen = blit::screen;
+            frameRect.x = (screen.bounds.w - frameWidth) / 2;
+            frameRect.y = (screen.bounds.h - frameHeight) / 2;
+
+            JPEGOutput out{screen.ptr(frameRect.x, frameRect.y), screen.row_stride, screen.bounds.w - frameRect.x, screen.bounds.h - frameRect.y};
+            out.paletted = screen.format == blit::PixelFormat::P;
+            out.scale = std::min(frameScale + adaptiveScale.getScale(), 3);
+            out.expand = out.scale - frameScale;
+            out.x = frameX;
+            out.y = frameY;
+
+            frameDecodeUs = 0;
+            bool canDecode = screen.format == blit::PixelFormat::RGB || screen.format == blit::PixelFormat::P;
+            frameOnScreen = canDecode && jpegDecoder.begin(buf, len, out);
+
+            if(frameOnScreen)
+            {
+                if(out.paletted)
+                    updatePalette(jpegDecoder.isGreyscale());
+
+                frameRect.w = jpegDecoder.getVisibleWidth();
+                frameRect.h = jpegDecoder.getVisibleHeight();
+
+                continueFrameDecode();
+            }
+            else
+            {
 #ifdef PROFILER
-            profilerVidDecProbe->start();
+                profilerVidDecProbe->start();
 #endif
-
-            if(jpeg.data)
-                delete[] jpeg.data;
-            jpeg = blit::decode_jpeg_buffer(buf, chunk.len);
+                // something our decoder can't handle, try the SDK one
+                decodeFrameBuf = &frameBuf;
+                jpeg = blit::decode_jpeg_buffer(buf, len, allocFrameBuffer);
+                frameRendered = false;
 
 #ifdef PROFILER
-            profilerVidDecProbe->store_elapsed_us();
+                profilerVidDecProbe->store_elapsed_us();
 #endif
+            }
 
-            delete[] buf;
             decodedFirstFrame = true;
         }
         else if(stream.type == StreamType::Audio)
@@ -238,7 +507,7 @@ void AVIFile::update(uint32_t time)
                 if(dataSize[i])
                     continue;
 
-                if(stream.curFrame >= stream.frameOffsets.size())
+                if(stream.ended)
                 {
                     dataSize[i] = -1;
                     continue;
@@ -248,21 +517,20 @@ void AVIFile::update(uint32_t time)
                 profilerAudReadProbe->start();
 #endif
 
-                auto chunk = readChunk(file, stream.curOffset);
-
                 int read = 0;
 
                 if(audioFormat == AudioFormat::PCM)
                 {
                     // raw data
-                    while(read + chunk.len / 2 < audioBufSize)
+                    while(read + stream.curSize / 2 < audioBufSize)
                     {
-                        file.read(stream.curOffset + 8, chunk.len, reinterpret_cast<char *>(audioBuf[i] + read));
-                        read += chunk.len / 2;
+                        {
+                            NoAllocScope noAlloc;
+                            readBuffer.read(stream.curOffset + 8, stream.curSize, reinterpret_cast<char *>(audioBuf[i] + read));
+                        }
+                        read += stream.curSize / 2;
                         if(!nextFrame(stream))
                             break;
-
-                        chunk = readChunk(file, stream.curOffset);
                     }
                 }
                 else if(audioFormat == AudioFormat::MP3)
@@ -270,17 +538,28 @@ void AVIFile::update(uint32_t time)
                     // guess a bit how much data we can decode
                     while(read + MINIMP3_MAX_SAMPLES_PER_FRAME / 2 < audioBufSize)
                     {
-                        auto buf = new uint8_t[chunk.len];
-                        file.read(stream.curOffset + 8, chunk.len, reinterpret_cast<char *>(buf));
-                        mp3dec_frame_info_t info;
-                        read += mp3dec_decode_frame(&mp3dec, buf, chunk.len, audioBuf[i] + read, &info);
+                        if(stream.curSize > maxChunkSize)
+                        {
+                            if(!nextFrame(stream))
+                                break;
 
-                        delete[] buf;
+                            continue;
+                        }
+
+                        if(audioChunkBuf.size() < stream.curSize)
+                            audioChunkBuf.resize(stream.curSize);
+
+                        {
+                            NoAllocScope noAlloc;
+
+                            auto buf = audioChunkBuf.data();
+                            readBuffer.read(stream.curOffset + 8, stream.curSize, reinterpret_cast<char *>(buf));
+                            mp3dec_frame_info_t info;
+                            read += mp3dec_decode_frame(&mp3dec, buf, stream.curSize, audioBuf[i] + read, &info);
+                        }
 
                         if(!nextFrame(stream))
                             break;
-
-                        chunk = readChunk(file, stream.curOffset);
                     }
                 }
 
@@ -302,21 +581,180 @@ void AVIFile::update(uint32_t time)
             }
         }
     }
+
+    // everything before the oldest chunk still needed can be dropped
+    // (the current video frame has already been read, the current audio chunk hasn't)
+    uint32_t minOffset = frameDataEnd;
+    for(auto &stream : streams)
+    {
+        if(stream.ended)
+            continue;
+
+        if(stream.type == StreamType::Video)
+            minOffset = std::min(minOffset, stream.curOffset + 8 + stream.curSize);
+        else
+            minOffset = std::min(minOffset, stream.curOffset);
+    }
+
+    readBuffer.discard(minOffset);
 }
 
 void AVIFile::render()
 {
+    NoAllocScope noAlloc;
+
+#ifdef PROFILER
+    // the profiler overlay is drawn on top, so redraw everything under it
+    frameRendered = bordersCleared = false;
+#endif
+
+#ifdef HOST_BUILD
+    auto frame = framePipeline.present(videoTime);
+    auto frameIndex = frame ? frame->frame : noFrame;
+
+#ifdef PROFILER
+    // decoded on another thread, so timed there
+    if(frame && frameIndex != renderedFrame)
+        profilerVidDecProbe->store_elapsed_us(frame->decodeUs);
+#endif
+
+    // still on the screen from the last render
+    if(frameRendered && frameIndex == renderedFrame)
+        return;
+
+    frameRendered = true;
+    renderedFrame = frameIndex;
+
+    if(!frame)
+    {
+        fillRect(blit::Rect(0, 0, blit::screen.bounds.w, blit::screen.bounds.h));
+        bordersCleared = false;
+        return;
+    }
+
+    auto w = std::min(frame->width, blit::screen.bounds.w);
+    auto h = std::min(frame->height, blit::screen.bounds.h);
+    auto xOff = (blit::screen.bounds.w - w) / 2;
+    auto yOff = (blit::screen.bounds.h - h) / 2;
+
+    // only frames from the SDK decoder can be bigger than the screen
+    auto crop = fallbackCropOffset(frame->width, frame->height);
+    auto src = frame->data + crop.y * frame->stride + crop.x * (frame->paletted ? 1 : 3);
+
+    clearBorders(blit::Rect(xOff, yOff, w, h));
+
+    if(frame->paletted)
+    {
+        updatePalette(frame->greyscale);
+
+        for(int y = 0; y < h; y++)
+            memcpy(blit::screen.ptr(xOff, y + yOff), src + y * frame->stride, w);
+    }
+    else if(blit::screen.format == blit::PixelFormat::P)
+    {
+        // from the SDK decoder
+        updatePalette(false);
+
+        for(int y = 0; y < h; y++)
+            JPEGDecoder::ditherRow(src + y * frame->stride, blit::screen.ptr(xOff, y + yOff), w, xOff, y + yOff);
+    }
+    else
+    {
+        for(int y = 0; y < h; y++)
+            memcpy(blit::screen.ptr(xOff, y + yOff), src + y * frame->stride, w * 3);
+    }
+#else
+    // decoded in place, only the borders need clearing
+    if(frameOnScreen)
+    {
+        // decoding is spread over updates, but a frame can't span a render or the top and bottom would be from different frames
+        while(jpegDecoder.isDecoding())
+            continueFrameDecode();
+
+        clearBorders(frameRect);
+        return;
+    }
+
+    if(frameRendered)
+        return;
+
+    frameRendered = true;
+
     if(!jpeg.data)
+    {
+        fillRect(blit::Rect(0, 0, blit::screen.bounds.w, blit::screen.bounds.h));
+        bordersCleared = false;
         return;
+    }
 
-    auto xOff = (blit::screen.bounds.w - jpeg.size.w) / 2;
-    auto yOff = (blit::screen.bounds.h - jpeg.size.h) / 2;
+    // the SDK decoder can't scale, so crop anything bigger than the screen
+    auto w = std::min(jpeg.size.w, blit::screen.bounds.w);
+    auto h = std::min(jpeg.size.h, blit::screen.bounds.h);
+    auto xOff = (blit::screen.bounds.w - w) / 2;
+    auto yOff = (blit::screen.bounds.h - h) / 2;
+    auto crop = fallbackCropOffset(jpeg.size.w, jpeg.size.h);
+    auto src = jpeg.data + (crop.y * jpeg.size.w + crop.x) * 3;
 
-    for(int y = 0; y < jpeg.size.h; y++)
+    clearBorders(blit::Rect(xOff, yOff, w, h));
+
+    bool paletted = blit::screen.format == blit::PixelFormat::P;
+
+    if(paletted)
+        updatePalette(false);
+
+    for(int y = 0; y < h; y++)
     {
         auto p = blit::screen.ptr(xOff, y + yOff);
-        memcpy(p, jpeg.data + y * jpeg.size.w * 3, jpeg.size.w * 3);
+
+        if(paletted)
+            JPEGDecoder::ditherRow(src + y * jpeg.size.w * 3, p, w, xOff, y + yOff);
+        else
+            memcpy(p, src + y * jpeg.size.w * 3, w * 3);
+    }
+#endif
+}
+
+// the SDK decoder can't scale or crop, so pick the part of a full size frame to show
+// the same part as the cropped view, or the middle if the view is scaled down
+blit::Point AVIFile::fallbackCropOffset(int width, int height) const
+{
+    auto maxX = std::max(width - blit::screen.bounds.w, 0);
+    auto maxY = std::max(height - blit::screen.bounds.h, 0);
+
+    if(frameScale == 0)
+        return blit::Point(std::min(frameX, maxX), std::min(frameY, maxY));
+
+    return blit::Point(maxX / 2, maxY / 2);
+}
+
+// clears the screen around the frame, unless that's already been done for the same area
+void AVIFile::clearBorders(const blit::Rect &r)
+{
+    auto &c = clearedRect;
+    if(bordersCleared && r.x == c.x && r.y == c.y && r.w == c.w && r.h == c.h)
+        return;
+
+    auto w = blit::screen.bounds.w, h = blit::screen.bounds.h;
+    fillRect(blit::Rect(0, 0, w, r.y));
+    fillRect(blit::Rect(0, r.y + r.h, w, h - r.y - r.h));
+    fillRect(blit::Rect(0, r.y, r.x, r.h));
+    fillRect(blit::Rect(r.x + r.w, r.y, w - r.x - r.w, r.h));
+
+    clearedRect = r;
+    bordersCleared = true;
+}
+
+// with the current pen, or index 0 (black) on paletted screens as the pen colour may not be in the palette
+void AVIFile::fillRect(const blit::Rect &r)
+{
+    if(blit::screen.format != blit::PixelFormat::P)
+    {
+        blit::screen.rectangle(r);
+        return;
     }
+
+    for(int y = r.y; y < r.y + r.h; y++)
+        memset(blit::screen.ptr(r.x, y), 0, r.w);
 }
 
 bool AVIFile::parseHeaders(uint32_t offset, uint32_t len)
@@ -329,12 +767,6 @@ bool AVIFile::parseHeaders(uint32_t offset, uint32_t len)
     if(file.read(offset + 8, sizeof(AVIHChunk), reinterpret_cast<char *>(&mainHead)) != sizeof(AVIHChunk))
         return false;
 
-    if(mainHead.width > static_cast<uint32_t>(blit::screen.bounds.w) || mainHead.height > static_cast<uint32_t>(blit::screen.bounds.h))
-    {
-        printf("file size %" PRIu32 "x%" PRIu32 " is bigger than the screen...\n", mainHead.width, mainHead.height);
-        return false;
-    }
-
     //printf("us/f %u maxbps %u align %u flags %x frames %u initframes %u streams %u sugbufsize %u w %u h %u\n", mainHead.usPerFrame, mainHead.maxBytesPerSec, mainHead.alignment, mainHead.flags, mainHead.numFrames, mainHead.initialFrames, mainHead.numStreams, mainHead. suggestedBufferSize, mainHead.width, mainHead.height);
 
     offset += chunk.len + 8;
@@ -425,6 +857,7 @@ bool AVIFile::parseHeaders(uint32_t offset, uint32_t len)
 
         Stream stream;
         stream.length = streamHeader.length;
+        stream.suggestedBufferSize = streamHeader.suggestedBufferSize;
 
         if(streamType == "vids")
             stream.type = StreamType::Video;
@@ -439,9 +872,17 @@ bool AVIFile::parseHeaders(uint32_t offset, uint32_t len)
             auto strChunk = readChunk(file, offset);
             std::string idStr(strChunk.id, 4);
 
-            puts(idStr.c_str());
-            
+            if(idStr == "indx")
+            {
+                if(!parseSuperIndex(stream, offset + 8, strChunk.len))
+                    return false;
+            }
+            else
+                puts(idStr.c_str());
+
             offset += strChunk.len + 8;
+            if(strChunk.len & 1)
+                offset++;
         }
 
         streams.push_back(stream);
@@ -450,21 +891,541 @@ bool AVIFile::parseHeaders(uint32_t offset, uint32_t len)
     return true;
 }
 
+void AVIFile::parseIndex(uint32_t maxEntries)
+{
+#ifdef PROFILER
+    profilerIdxLoadProbe->start();
+#endif
+
+    // read the index in large blocks instead of per-entry
+    while(indexOffset < indexEnd && maxEntries)
+    {
+        auto numEntries = std::min({(indexEnd - indexOffset) / 16, uint32_t(idxBlockEntries), maxEntries});
+
+        if(!numEntries || file.read(indexOffset, numEntries * 16, reinterpret_cast<char *>(indexBlock)) != int32_t(numEntries * 16))
+        {
+            // truncated
+            indexOffset = indexEnd;
+            break;
+        }
+
+        for(auto entry = indexBlock; entry != indexBlock + numEntries * 4; entry += 4)
+        {
+            // id, flags, offset, size
+            auto id = reinterpret_cast<char *>(entry);
+
+            // skip anything that isn't a stream chunk ("rec " lists)
+            if(id[0] < '0' || id[0] > '9' || id[1] < '0' || id[1] > '9')
+                continue;
+
+            unsigned int streamNum = (id[0] - '0') * 10 + (id[1] - '0');
+
+            if(streamNum >= streams.size())
+                continue;
+
+            // points past the end of the data, checked separately so a broken size can't wrap around
+            auto dataLen = frameDataEnd - frameDataOffset;
+            if(entry[2] > dataLen || dataLen - entry[2] < 8 || entry[3] > dataLen - entry[2] - 8)
+                continue;
+
+            streams[streamNum].frameOffsets.push_back(entry[2], entry[3]);
+        }
+
+        indexOffset += numEntries * 16;
+        maxEntries -= numEntries;
+    }
+
+#ifdef PROFILER
+    profilerIdxLoadProbe->store_elapsed_us();
+#endif
+}
+
+uint32_t AVIFile::hashFileRange(uint32_t offset, uint32_t len)
+{
+    // FNV-1a
+    uint32_t hash = 0x811C9DC5;
+
+    auto buf = reinterpret_cast<uint8_t *>(indexBlock);
+
+    while(len)
+    {
+        auto readLen = std::min(len, uint32_t(sizeof(indexBlock)));
+        if(file.read(offset, readLen, reinterpret_cast<char *>(buf)) != int32_t(readLen))
+            return 0;
+
+        for(auto p = buf; p != buf + readLen; p++)
+            hash = (hash ^ *p) * 0x01000193;
+
+        offset += readLen;
+        len -= readLen;
+    }
+
+    return hash;
+}
+
+uint32_t AVIFile::hashFile()
+{
+    // there's no modification time, so check the start and end of the file
+    auto len = file.get_length();
+    auto hashLen = std::min(len, uint32_t(sizeof(indexBlock)));
+
+    return hashFileRange(0, hashLen) ^ hashFileRange(len - hashLen, hashLen);
+}
+
+bool AVIFile::loadIndexCache()
+{
+    blit::File cacheFile;
+    if(!cacheFile.open(indexCacheFilename))
+        return false;
+
+    IndexCacheHeader head;
+    if(cacheFile.read(0, sizeof(head), reinterpret_cast<char *>(&head)) != sizeof(head))
+        return false;
+
+    if(memcmp(head.magic, "MJIX", 4) != 0 || head.version != IndexCacheHeader::currentVersion)
+        return false;
+
+    if(head.fileLength != file.get_length() || head.fileHash != hashFile())
+        return false;
+
+    uint32_t offset = sizeof(head);
+
+    for(unsigned int i = 0; i < head.numStreams; i++)
+    {
+        IndexCacheStream streamHead;
+        if(cacheFile.read(offset, sizeof(streamHead), reinterpret_cast<char *>(&streamHead)) != sizeof(streamHead))
+            return false;
+
+        offset += sizeof(streamHead);
+
+        Stream stream;
+        stream.type = static_cast<StreamType>(streamHead.type);
+        stream.length = streamHead.length;
+        stream.suggestedBufferSize = streamHead.suggestedBufferSize;
+
+        auto tableLen = stream.frameOffsets.load(cacheFile, offset);
+        if(!tableLen)
+            return false;
+
+        offset += tableLen;
+
+        streams.push_back(std::move(stream));
+    }
+
+    mainHead = head.mainHead;
+    audioFormat = static_cast<AudioFormat>(head.audioFormat);
+    frameDataOffset = head.frameDataOffset;
+    frameDataEnd = head.frameDataEnd;
+    indexType = IndexType::Legacy;
+
+    return true;
+}
+
+void AVIFile::saveIndexCache()
+{
+    // only try once
+    indexCached = true;
+
+    blit::File cacheFile;
+    if(!cacheFile.open(indexCacheFilename, blit::OpenMode::write))
+        return;
+
+    IndexCacheHeader head;
+    memcpy(head.magic, "MJIX", 4);
+    head.version = IndexCacheHeader::currentVersion;
+    head.fileLength = file.get_length();
+    head.fileHash = hashFile();
+    head.mainHead = mainHead;
+    head.frameDataOffset = frameDataOffset;
+    head.frameDataEnd = frameDataEnd;
+    head.audioFormat = static_cast<uint32_t>(audioFormat);
+    head.numStreams = streams.size();
+
+    cacheFile.write(0, sizeof(head), reinterpret_cast<char *>(&head));
+
+    uint32_t offset = sizeof(head);
+
+    for(auto &stream : streams)
+    {
+        IndexCacheStream streamHead;
+        streamHead.type = static_cast<uint32_t>(stream.type);
+        streamHead.length = stream.length;
+        streamHead.suggestedBufferSize = stream.suggestedBufferSize;
+
+        cacheFile.write(offset, sizeof(streamHead), reinterpret_cast<char *>(&streamHead));
+        offset += sizeof(streamHead);
+
+        offset += stream.frameOffsets.save(cacheFile, offset);
+    }
+}
+
+bool AVIFile::parseSuperIndex(Stream &stream, uint32_t offset, uint32_t len)
+{
+    IndexChunk head;
+
+    if(len < sizeof(IndexChunk) || file.read(offset, sizeof(IndexChunk), reinterpret_cast<char *>(&head)) != sizeof(IndexChunk))
+        return false;
+
+    // AVI_INDEX_OF_INDEXES, ignore anything else
+    if(head.indexType != 0 || head.longsPerEntry != 4)
+    {
+        printf("Unsupported index type %i\n", head.indexType);
+        return true;
+    }
+
+    // the chunk may claim to be bigger than the file
+    len = std::min(len, uint32_t(file.get_length()) - offset);
+    auto numEntries = std::min(head.entriesInUse, (len - uint32_t(sizeof(IndexChunk))) / 16);
+
+    // qword offset, size, duration
+    std::vector<uint32_t> entries(numEntries * 4);
+    auto readLen = file.read(offset + sizeof(IndexChunk), numEntries * 16, reinterpret_cast<char *>(entries.data()));
+    numEntries = std::max(readLen, 0) / 16;
+
+    stream.superIndex.reserve(numEntries);
+
+    for(auto entry = entries.data(); entry != entries.data() + numEntries * 4; entry += 4)
+    {
+        // we can only read the first 4GB
+        if(entry[1])
+        {
+            printf("Index at 0x%08" PRIx32 "%08" PRIx32 " is out of range\n", entry[1], entry[0]);
+            break;
+        }
+
+        stream.superIndex.push_back(entry[0]);
+    }
+
+    return true;
+}
+
+bool AVIFile::openSubIndex(Stream &stream)
+{
+    auto offset = stream.superIndex[stream.subIndex];
+
+    auto chunk = readChunk(file, offset);
+
+    IndexChunk head;
+    if(file.read(offset + 8, sizeof(IndexChunk), reinterpret_cast<char *>(&head)) != sizeof(IndexChunk))
+        return false;
+
+    // AVI_INDEX_OF_CHUNKS
+    if(head.indexType != 1 || head.longsPerEntry != 2 || chunk.len < sizeof(IndexChunk))
+    {
+        printf("Unsupported sub-index type %i\n", head.indexType);
+        return false;
+    }
+
+    if(head.baseOffset[1])
+    {
+        printf("Sub-index base 0x%08" PRIx32 "%08" PRIx32 " is out of range\n", head.baseOffset[1], head.baseOffset[0]);
+        return false;
+    }
+
+    stream.subIndexOffset = offset + 8 + sizeof(IndexChunk);
+    stream.subIndexLen = std::min(head.entriesInUse, (chunk.len - uint32_t(sizeof(IndexChunk))) / 8);
+    stream.subIndexBase = head.baseOffset[0];
+    stream.subIndexPos = 0;
+    stream.subIndexCacheStart = 0;
+    stream.subIndexCache.clear();
+
+    return true;
+}
+
+bool AVIFile::loadSubIndexEntry(Stream &stream)
+{
+    // move on to the next sub-index
+    while(stream.subIndexPos >= stream.subIndexLen)
+    {
+        if(stream.subIndex + 1 >= stream.superIndex.size())
+            return false;
+
+        stream.subIndex++;
+
+        if(!openSubIndex(stream))
+            return false;
+    }
+
+    auto cachePos = stream.subIndexPos - stream.subIndexCacheStart;
+
+    // load a block of entries
+    if(stream.subIndexPos < stream.subIndexCacheStart || cachePos >= stream.subIndexCache.size() / 2)
+    {
+        auto numEntries = std::min(stream.subIndexLen - stream.subIndexPos, uint32_t(subIndexCacheEntries));
+        stream.subIndexCache.resize(numEntries * 2);
+        stream.subIndexCacheStart = stream.subIndexPos;
+        cachePos = 0;
+
+        auto readLen = numEntries * 8;
+        if(file.read(stream.subIndexOffset + stream.subIndexPos * 8, readLen, reinterpret_cast<char *>(stream.subIndexCache.data())) != int32_t(readLen))
+            return false;
+    }
+
+    // offset, size (top bit set if not a keyframe)
+    auto offset = uint64_t(stream.subIndexBase) + stream.subIndexCache[cachePos * 2];
+    auto size = stream.subIndexCache[cachePos * 2 + 1] & 0x7FFFFFFF;
+
+    // the offset is to the data, not the chunk header
+    if(offset < 8 || offset + size > frameDataEnd)
+        return false;
+
+    stream.curOffset = offset - 8;
+    stream.curSize = size;
+
+    return true;
+}
+
+bool AVIFile::findStreamChunk(Stream &stream, uint32_t offset)
+{
+    unsigned int streamNum = &stream - streams.data();
+
+    while(offset + 8 <= frameDataEnd)
+    {
+        Chunk chunk{};
+        readBuffer.read(offset, 8, reinterpret_cast<char *>(&chunk));
+
+        // "rec " list, look inside
+        if(memcmp(chunk.id, "LIST", 4) == 0)
+        {
+            offset += 12;
+            continue;
+        }
+
+        // chunk runs past the end of the file
+        if(chunk.len > frameDataEnd - offset - 8)
+            break;
+
+        if(chunk.id[0] >= '0' && chunk.id[0] <= '9' && chunk.id[1] >= '0' && chunk.id[1] <= '9')
+        {
+            if(unsigned((chunk.id[0] - '0') * 10 + (chunk.id[1] - '0')) == streamNum)
+            {
+                stream.curOffset = offset;
+                stream.curSize = chunk.len;
+                return true;
+            }
+        }
+
+        // anything else (other streams, JUNK, ix##) is skipped
+        offset += 8 + chunk.len;
+        if(chunk.len & 1)
+            offset++;
+    }
+
+    return false;
+}
+
 bool AVIFile::nextFrame(Stream &stream)
 {
-    if(stream.curFrame == stream.length)
+    if(stream.ended)
         return false;
 
+    if(indexType == IndexType::None)
+    {
+        auto offset = stream.curOffset + 8 + stream.curSize + (stream.curSize & 1);
+
+        if(!findStreamChunk(stream, offset))
+        {
+            stream.ended = true;
+            return false;
+        }
+
+        stream.curFrame++;
+        return true;
+    }
+    else if(indexType == IndexType::OpenDML)
+    {
+        stream.subIndexPos++;
+
+        if(!loadSubIndexEntry(stream))
+        {
+            stream.ended = true;
+            return false;
+        }
+
+        stream.curFrame++;
+        return true;
+    }
+
     stream.curFrame++;
 
-    if(stream.curFrame == stream.length)
+    // index not loaded this far yet
+    while(stream.curFrame == stream.frameOffsets.size() && indexOffset < indexEnd)
+        parseIndex(idxBlockEntries);
+
+    if(stream.curFrame == stream.frameOffsets.size())
+    {
+        stream.ended = true;
         return false;
+    }
 
-    stream.curOffset += stream.frameOffsets[stream.curFrame] * 2;
+    stream.frameOffsets.readNext(stream.indexPos, stream.curOffset, stream.curSize);
 
     return true;
 }
 
+// compares against the last frame read, hashing is a lot cheaper than decoding
+bool AVIFile::isDuplicateFrame(const uint8_t *data, uint32_t len)
+{
+    // FNV-1a, a word at a time
+    uint32_t hash = 0x811C9DC5;
+    uint32_t i = 0;
+
+    for(; i + 4 <= len; i += 4)
+    {
+        uint32_t word;
+        memcpy(&word, data + i, 4);
+        hash = (hash ^ word) * 0x01000193;
+    }
+
+    for(; i < len; i++)
+        hash = (hash ^ data[i]) * 0x01000193;
+
+    bool duplicate = len == lastFrameLen && hash == lastFrameHash;
+
+    lastFrameLen = len;
+    lastFrameHash = hash;
+
+    return duplicate;
+}
+
+// picks the scale and part of the frame to decode
+// small videos fill the screen in lores, which is pixel doubled for free
+void AVIFile::setScreenMode()
+{
+    if(mainHead.width <= loresWidth && mainHead.height <= loresHeight)
+        blit::set_screen_mode(blit::ScreenMode::lores);
+    else if(paletted)
+        blit::set_screen_mode(blit::ScreenMode::hires_palette);
+    else
+        blit::set_screen_mode(blit::ScreenMode::hires);
+
+    paletteSet = false;
+}
+
+void AVIFile::updateView()
+{
+    if(cropped || fitScale > 3)
+    {
+        frameScale = 0;
+        frameX = viewX;
+        frameY = viewY;
+        frameWidth = std::min(int(mainHead.width), blit::screen.bounds.w);
+        frameHeight = std::min(int(mainHead.height), blit::screen.bounds.h);
+    }
+    else
+    {
+        frameScale = fitScale;
+        frameX = frameY = 0;
+        frameWidth = (mainHead.width + (1 << frameScale) - 1) >> frameScale;
+        frameHeight = (mainHead.height + (1 << frameScale) - 1) >> frameScale;
+    }
+
+    // the next frame needs decoding with the new view, even if it's the same as the last one
+    lastFrameLen = 0;
+
+#ifdef HOST_BUILD
+    framePipeline.setView(frameWidth, frameHeight, frameScale, frameX, frameY, blit::screen.format == blit::PixelFormat::P);
+#endif
+}
+
+// greyscale files get a palette of greys, everything else the colour cube
+void AVIFile::updatePalette(bool greyscale)
+{
+    if(paletteSet && greyscale == paletteGreyscale)
+        return;
+
+    auto rgb = JPEGDecoder::getPalette(greyscale);
+    blit::Pen pens[256];
+
+    for(int i = 0; i < 256; i++)
+        pens[i] = blit::Pen(rgb[i * 3], rgb[i * 3 + 1], rgb[i * 3 + 2]);
+
+    blit::set_screen_palette(pens, 256);
+
+    paletteSet = true;
+    paletteGreyscale = greyscale;
+}
+
+// decodes rows of the current frame until it's finished or this update has used its time
+void AVIFile::continueFrameDecode()
+{
+    auto start = blit::now_us();
+
+#ifdef PROFILER
+    profilerVidDecProbe->start();
+#endif
+
+    bool finished;
+    {
+        // buffers are sized in begin(), so the rows shouldn't need anything else
+        NoAllocScope noAlloc;
+
+        while(!(finished = jpegDecoder.decodeStep(decodeStepRows)))
+        {
+            if(blit::now_us() - start >= decodeBudgetUs)
+                break;
+        }
+    }
+
+    frameDecodeUs += blit::now_us() - start;
+
+    if(finished)
+        adaptiveScale.addFrame(frameDecodeUs);
+
+#ifdef PROFILER
+    profilerVidDecProbe->store_elapsed_us();
+#endif
+}
+
+#ifdef HOST_BUILD
+// reads frames into the pipeline until it's full, skipping any that would be late
+void AVIFile::queueVideoFrames(Stream &stream, uint32_t time)
+{
+    while(framePipeline.hasFreeSlot())
+    {
+        if(videoQueued)
+        {
+            if(!nextFrame(stream))
+                break;
+
+            videoQueued = false;
+        }
+
+        auto nextFrameTime = ((stream.curFrame + 1) * mainHead.usPerFrame) / 1000;
+
+        while(nextFrameTime <= time && nextFrame(stream))
+            nextFrameTime = ((stream.curFrame + 1) * mainHead.usPerFrame) / 1000;
+
+        videoQueued = true;
+
+        auto len = stream.curSize;
+
+        if(len == 0 || len > maxChunkSize)
+            continue;
+
+        auto buf = framePipeline.getQueueBuffer(len);
+
+#ifdef PROFILER
+        profilerVidReadProbe->start();
+#endif
+        {
+            NoAllocScope noAlloc;
+            readBuffer.read(stream.curOffset + 8, len, (char *)buf);
+        }
+
+#ifdef PROFILER
+        profilerVidReadProbe->store_elapsed_us();
+#endif
+
+        // keep showing the last frame, the slot stays free
+        if(isDuplicateFrame(buf, len))
+            continue;
+
+        framePipeline.queue(stream.curFrame, (stream.curFrame * mainHead.usPerFrame) / 1000, len);
+    }
+}
+#endif
+
 void AVIFile::staticAudioCallback(blit::AudioChannel &channel)
 {
     reinterpret_cast<AVIFile *>(channel.user_data)->audioCallback(channel);
@@ -11,6 +11,32 @@
 #include "engine/file.hpp"
 #include "graphics/jpeg.hpp"
 
+#include "adaptive-scale.hpp"
+#include "jpeg-decoder.hpp"
+#ifdef HOST_BUILD
+#include "frame-pipeline.hpp"
+#endif
+#include "offset-table.hpp"
+#include "read-buffer.hpp"
+
+// stream data read-ahead, should cover the distance between the audio and video read positions
+#ifndef READ_BUFFER_SIZE
+#ifdef HOST_BUILD
+#define READ_BUFFER_SIZE (1024 * 1024)
+#else
+#define READ_BUFFER_SIZE (64 * 1024)
+#endif
+#endif
+
+// bigger chunks are assumed to be from a broken index and skipped
+#ifndef MAX_CHUNK_SIZE
+#ifdef HOST_BUILD
+#define MAX_CHUNK_SIZE (16 * 1024 * 1024)
+#else
+#define MAX_CHUNK_SIZE (512 * 1024)
+#endif
+#endif
+
 struct Chunk
 {
     char id[4];
@@ -53,9 +79,22 @@ struct STRHChunk
     int16_t frameBottom;
 };
 
+// OpenDML super/standard index
+struct IndexChunk
+{
+    uint16_t longsPerEntry;
+    uint8_t indexSubType;
+    uint8_t indexType;
+    uint32_t entriesInUse;
+    char chunkId[4];
+    uint32_t baseOffset[2]; // standard index only
+    uint32_t reserved;
+};
+
 static_assert(sizeof(Chunk) == 8);
 static_assert(sizeof(AVIHChunk) == 40);
 static_assert(sizeof(STRHChunk) == 56);
+static_assert(sizeof(IndexChunk) == 24);
 
 enum class StreamType
 {
@@ -69,10 +108,30 @@ struct Stream
     StreamType type;
     // more
     uint32_t length;
+    uint32_t suggestedBufferSize;
 
     uint32_t curFrame = 0;
-    uint32_t curOffset = 0;
-    std::vector<uint16_t> frameOffsets;
+    uint32_t curOffset = 0; // chunk header
+    uint32_t curSize = 0;
+    bool ended = false;
+    OffsetTable frameOffsets;
+    uint32_t indexPos = 0; // position of the next entry in frameOffsets
+
+    // OpenDML
+    std::vector<uint32_t> superIndex; // ix## chunk offsets
+    unsigned int subIndex = 0;
+    uint32_t subIndexOffset = 0, subIndexLen = 0, subIndexBase = 0;
+    uint32_t subIndexPos = 0;
+
+    uint32_t subIndexCacheStart = 0;
+    std::vector<uint32_t> subIndexCache; // offset, size
+};
+
+enum class IndexType
+{
+    None, // scan the stream data
+    Legacy, // idx1
+    OpenDML // indx + ix##
 };
 
 enum class AudioFormat
@@ -82,9 +141,33 @@ enum class AudioFormat
     MP3
 };
 
+// sidecar file with the parsed headers and index
+struct IndexCacheHeader
+{
+    static const uint32_t currentVersion = 3;
+
+    char magic[4];
+    uint32_t version;
+    uint32_t fileLength;
+    uint32_t fileHash;
+    AVIHChunk mainHead;
+    uint32_t frameDataOffset, frameDataEnd;
+    uint32_t audioFormat;
+    uint32_t numStreams;
+    // IndexCacheStream + OffsetTable for each stream
+};
+
+struct IndexCacheStream
+{
+    uint32_t type;
+    uint32_t length;
+    uint32_t suggestedBufferSize;
+};
+
 class AVIFile
 {
 public:
+    // also picks the screen mode for the file
     bool load(std::string filename);
 
     void play(int audioChannel);
@@ -95,10 +178,45 @@ public:
 
     bool getPlaying() const {return playing;}
 
+    // show files bigger than the screen at full size instead of scaling them down, panning around the frame
+    void setCropped(bool cropped);
+    bool getCropped() const {return cropped;}
+    void pan(int dx, int dy);
+
+    // use the 8-bit paletted screen mode with dithered frames, a third of the framebuffer writes of RGB
+    // lores has no paletted mode, so small files stay RGB
+    void setPaletted(bool paletted);
+    bool getPaletted() const {return paletted;}
+
 private:
+    bool parseFile();
     bool parseHeaders(uint32_t offset, uint32_t len);
 
+    void parseIndex(uint32_t maxEntries);
+    bool parseSuperIndex(Stream &stream, uint32_t offset, uint32_t len);
+    bool openSubIndex(Stream &stream);
+    bool loadSubIndexEntry(Stream &stream);
+    bool findStreamChunk(Stream &stream, uint32_t offset);
+
+    uint32_t hashFileRange(uint32_t offset, uint32_t len);
+    uint32_t hashFile();
+    bool loadIndexCache();
+    void saveIndexCache();
+
     bool nextFrame(Stream &stream);
+    bool isDuplicateFrame(const uint8_t *data, uint32_t len);
+
+    void setScreenMode();
+    void updateView();
+    void updatePalette(bool greyscale);
+    void clearBorders(const blit::Rect &r);
+    void fillRect(const blit::Rect &r);
+    blit::Point fallbackCropOffset(int width, int height) const;
+    void continueFrameDecode();
+
+#ifdef HOST_BUILD
+    void queueVideoFrames(Stream &stream, uint32_t time);
+#endif
 
     static void staticAudioCallback(blit::AudioChannel &channel);
     void audioCallback(blit::AudioChannel &channel);
@@ -106,16 +224,81 @@ private:
     bool playing = false;
     bool decodedFirstFrame = false;
 
-    blit::JPEGImage jpeg = {};
+    // frames identical to the last one read are skipped
+    uint32_t lastFrameLen = 0; // 0 if the next frame needs decoding anyway
+    uint32_t lastFrameHash = 0;
+
+    JPEGDecoder jpegDecoder;
+
+    // frames that take longer than this are finished over multiple updates (before the next render), so audio keeps getting refilled
+    static const uint32_t decodeBudgetUs = 6000;
+    static const int decodeStepRows = 1;
+
+    // decode at a lower resolution when frames take too long
+    AdaptiveScale adaptiveScale;
+    uint32_t frameDecodeUs = 0;
+    bool frameOnScreen = false;
+    blit::Rect frameRect;
+    bool frameRendered = false; // nothing new to draw since the last render
+    bool bordersCleared = false; // around clearedRect
+    blit::Rect clearedRect;
+
+    static const int loresWidth = 160, loresHeight = 120;
+
+    bool paletted = false;
+    bool paletteSet = false; // since the last screen mode change
+    bool paletteGreyscale = false;
+
+    // files bigger than the screen are decoded at 1 / (1 << frameScale) size, or cropped
+    int fitScale = 0; // smallest scale that fits the screen, 4 if none do
+    bool cropped = false;
+    int viewX = 0, viewY = 0; // top left of the cropped view
+    int frameScale = 0;
+    int frameX = 0, frameY = 0; // part of the frame shown, after scaling
+    int frameWidth = 0, frameHeight = 0;
+
+#ifdef HOST_BUILD
+    // frames are read ahead and decoded on another thread
+    FramePipeline framePipeline{jpegDecoder};
+    bool videoQueued = false; // the current video chunk has been queued
+    uint32_t videoTime = 0;
+    static constexpr uint32_t noFrame = ~0u;
+    uint32_t renderedFrame = noFrame;
+#endif
+
+    // fallback for anything jpegDecoder can't handle
+    blit::JPEGImage jpeg = {}; // data points into frameBuf
+    std::vector<uint8_t> frameBuf;
 
     blit::File file;
-    uint32_t frameDataOffset;
+    uint32_t frameDataOffset, frameDataEnd;
+
+    static const uint32_t readBufferSize = READ_BUFFER_SIZE;
+    ReadBuffer readBuffer;
+
+    // compressed chunks, preallocated from the suggested buffer sizes
+    static const uint32_t maxSuggestedBufferSize = 128 * 1024;
+    static const uint32_t maxChunkSize = MAX_CHUNK_SIZE;
+    std::vector<uint8_t> videoChunkBuf, audioChunkBuf;
 
     AVIHChunk mainHead;
     std::vector<Stream> streams;
     uint32_t startTime = 0;
     AudioFormat audioFormat = AudioFormat::None;
 
+    IndexType indexType = IndexType::None;
+
+    // idx1 loading
+    static const int idxBlockEntries = 256; // 4k
+    static const int initialIndexEntries = 1024;
+    uint32_t indexBlock[idxBlockEntries * 4];
+    uint32_t indexOffset = 0, indexEnd = 0;
+
+    static const int subIndexCacheEntries = 128; // 1k per stream
+
+    std::string indexCacheFilename;
+    bool indexCached = false;
+
     // audio bits
     int channel = -1;
 
@@ -0,0 +1,260 @@
+#ifdef HOST_BUILD
+
+#include <algorithm>
+
+#include "engine/engine.hpp"
+#include "graphics/jpeg.hpp"
+
+#include "frame-pipeline.hpp"
+
+// decode_jpeg_buffer's allocator has no context, only used from the decode thread
+static std::vector<uint8_t> *decodeFrameBuf = nullptr;
+
+static void *allocFrameBuffer(size_t size)
+{
+    if(decodeFrameBuf->size() < size)
+        decodeFrameBuf->resize(size);
+
+    return decodeFrameBuf->data();
+}
+
+FramePipeline::~FramePipeline()
+{
+    if(!thread.joinable())
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        quit = true;
+    }
+    queuedCond.notify_all();
+
+    thread.join();
+}
+
+void FramePipeline::start(int maxWidth, int maxHeight, uint32_t frameUs)
+{
+    flush();
+
+    adaptiveScale.reset(frameUs);
+
+    // allocate up front, as long as the size doesn't change this only happens once
+    for(auto &slot : slots)
+    {
+        if(slot.pixels.size() < size_t(maxWidth * maxHeight * 3))
+            slot.pixels.resize(maxWidth * maxHeight * 3);
+    }
+
+    if(!thread.joinable())
+        thread = std::thread(&FramePipeline::run, this);
+}
+
+void FramePipeline::setView(int width, int height, int scale, int x, int y, bool paletted)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    view.width = width;
+    view.height = height;
+    view.scale = scale;
+    view.x = x;
+    view.y = y;
+    view.paletted = paletted;
+}
+
+void FramePipeline::flush()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+
+    idleCond.wait(lock, [this]
+    {
+        return std::none_of(std::begin(slots), std::end(slots), [](const Slot &slot){return slot.state == SlotState::Decoding;});
+    });
+
+    for(auto &slot : slots)
+        slot.state = SlotState::Free;
+
+    queueSlot = -1;
+    presentTime = 0;
+}
+
+bool FramePipeline::hasFreeSlot()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    return std::any_of(std::begin(slots), std::end(slots), [](const Slot &slot){return slot.state == SlotState::Free;});
+}
+
+uint8_t *FramePipeline::getQueueBuffer(uint32_t len)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        queueSlot = -1;
+        for(int i = 0; i < numSlots && queueSlot == -1; i++)
+        {
+            if(slots[i].state == SlotState::Free)
+                queueSlot = i;
+        }
+    }
+
+    if(queueSlot == -1)
+        return nullptr;
+
+    // free slots aren't touched by the decode thread
+    auto &data = slots[queueSlot].data;
+    if(data.size() < len)
+        data.resize(len);
+
+    return data.data();
+}
+
+void FramePipeline::queue(uint32_t frame, uint32_t showTime, uint32_t len)
+{
+    if(queueSlot == -1)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        auto &slot = slots[queueSlot];
+        slot.frame = frame;
+        slot.showTime = showTime;
+        slot.len = len;
+        slot.state = SlotState::Queued;
+        queueSlot = -1;
+    }
+
+    queuedCond.notify_one();
+}
+
+const FramePipeline::Frame *FramePipeline::present(uint32_t time)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    presentTime = time;
+
+    Slot *due = nullptr, *shown = nullptr;
+
+    for(auto &slot : slots)
+    {
+        if(slot.state == SlotState::Shown)
+            shown = &slot;
+        else if(slot.state == SlotState::Decoded && slot.showTime <= time && (!due || slot.frame > due->frame))
+            due = &slot;
+    }
+
+    if(!due)
+        return shown ? &shown->output : nullptr;
+
+    // anything older than the new frame was decoded too late to be shown
+    for(auto &slot : slots)
+    {
+        if(slot.state == SlotState::Shown || (slot.state == SlotState::Decoded && slot.frame < due->frame))
+            slot.state = SlotState::Free;
+    }
+
+    due->state = SlotState::Shown;
+
+    return &due->output;
+}
+
+void FramePipeline::run()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+
+    while(true)
+    {
+        int index;
+        queuedCond.wait(lock, [this, &index]{return quit || (index = nextQueuedSlot()) != -1;});
+
+        if(quit)
+            return;
+
+        auto &slot = slots[index];
+        slot.state = SlotState::Decoding;
+        auto frameView = view;
+
+        lock.unlock();
+        bool decoded = decodeSlot(slot, frameView);
+        lock.lock();
+
+        slot.state = decoded ? SlotState::Decoded : SlotState::Free;
+        idleCond.notify_all();
+    }
+}
+
+// oldest queued frame, skipping any that a newer frame is already due to replace
+int FramePipeline::nextQueuedSlot()
+{
+    while(true)
+    {
+        int next = -1;
+        bool newerDue = false;
+
+        for(int i = 0; i < numSlots; i++)
+        {
+            if(slots[i].state == SlotState::Queued && (next == -1 || slots[i].frame < slots[next].frame))
+                next = i;
+        }
+
+        if(next == -1)
+            return -1;
+
+        for(int i = 0; i < numSlots; i++)
+        {
+            if(i != next && slots[i].state == SlotState::Queued && slots[i].showTime <= presentTime)
+                newerDue = true;
+        }
+
+        if(!newerDue)
+            return next;
+
+        slots[next].state = SlotState::Free;
+    }
+}
+
+bool FramePipeline::decodeSlot(Slot &slot, const View &view)
+{
+    JPEGOutput out{slot.pixels.data(), view.width * (view.paletted ? 1 : 3), view.width, view.height};
+    out.scale = std::min(view.scale + adaptiveScale.getScale(), 3);
+    out.expand = out.scale - view.scale;
+    out.x = view.x;
+    out.y = view.y;
+    out.paletted = view.paletted;
+
+    bool ret = true;
+    auto start = blit::now_us();
+
+    if(decoder.decode(slot.data.data(), slot.len, out))
+    {
+        adaptiveScale.addFrame(blit::now_us() - start);
+
+        slot.output.data = out.data;
+        slot.output.width = decoder.getVisibleWidth();
+        slot.output.height = decoder.getVisibleHeight();
+        slot.output.stride = out.stride;
+        slot.output.paletted = out.paletted;
+        slot.output.greyscale = decoder.isGreyscale();
+    }
+    else
+    {
+        // something our decoder can't handle, try the SDK one
+        decodeFrameBuf = &slot.pixels;
+        auto jpeg = blit::decode_jpeg_buffer(slot.data.data(), slot.len, allocFrameBuffer);
+
+        slot.output.data = jpeg.data;
+        slot.output.width = jpeg.size.w;
+        slot.output.height = jpeg.size.h;
+        slot.output.stride = jpeg.size.w * 3;
+        slot.output.paletted = slot.output.greyscale = false;
+
+        ret = jpeg.data != nullptr;
+    }
+
+    slot.output.frame = slot.frame;
+    slot.output.decodeUs = blit::now_us() - start;
+
+    return ret;
+}
+
+#endif
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "adaptive-scale.hpp"
+#include "jpeg-decoder.hpp"
+
+// decodes video frames on another thread, a few frames ahead of when they're shown (desktop builds only)
+// the main thread queues compressed frames and picks the decoded frame that is due when rendering
+class FramePipeline
+{
+public:
+    struct Frame
+    {
+        const uint8_t *data; // RGB888, or palette indices if paletted
+        int width, height;
+        int stride;
+
+        bool paletted, greyscale; // greyscale frames use the grey palette
+
+        uint32_t frame;
+        uint32_t decodeUs; // for profiling on the main thread
+    };
+
+    FramePipeline(JPEGDecoder &decoder) : decoder(decoder) {}
+    ~FramePipeline();
+
+    // sets the size of the output buffers and starts the thread
+    void start(int maxWidth, int maxHeight, uint32_t frameUs);
+
+    // part of the frame to decode, applies to frames that haven't started decoding yet
+    // width and height are the size after decoding at 1 / (1 << scale), x and y are the offset into the scaled frame
+    void setView(int width, int height, int scale, int x = 0, int y = 0, bool paletted = false);
+
+    // drops all queued and decoded frames, waits for the decoder to be idle
+    void flush();
+
+    bool hasFreeSlot();
+
+    // returns a buffer for the next frame's data, or nullptr if all the slots are in use
+    uint8_t *getQueueBuffer(uint32_t len);
+    void queue(uint32_t frame, uint32_t showTime, uint32_t len);
+
+    // returns the latest frame due at time, nullptr if there isn't one yet
+    const Frame *present(uint32_t time);
+
+private:
+    enum class SlotState
+    {
+        Free,
+        Queued,
+        Decoding,
+        Decoded,
+        Shown
+    };
+
+    struct Slot
+    {
+        SlotState state = SlotState::Free;
+
+        uint32_t frame = 0;
+        uint32_t showTime = 0;
+
+        std::vector<uint8_t> data; // compressed
+        uint32_t len = 0;
+
+        std::vector<uint8_t> pixels;
+        Frame output;
+    };
+
+    struct View
+    {
+        int width = 0, height = 0;
+        int scale = 0;
+        int x = 0, y = 0;
+        bool paletted = false;
+    };
+
+    void run();
+    int nextQueuedSlot();
+    bool decodeSlot(Slot &slot, const View &view);
+
+    static const int numSlots = 4;
+
+    JPEGDecoder &decoder;
+    View view;
+    AdaptiveScale adaptiveScale; // only used by the decode thread
+
+    Slot slots[numSlots];
+    int queueSlot = -1;
+    uint32_t presentTime = 0;
+
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable queuedCond, idleCond;
+    bool quit = false;
+};
@@ -0,0 +1,1931 @@
+#include <algorithm>
+#include <cstring>
+
+#ifdef HOST_BUILD
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#endif
+
+#include "jpeg-decoder.hpp"
+
+#ifdef PROFILER
+#include "engine/profiler.hpp"
+
+extern blit::ProfilerProbe *profilerVidEntropyProbe;
+extern blit::ProfilerProbe *profilerVidIDCTProbe;
+extern blit::ProfilerProbe *profilerVidColourProbe;
+#endif
+
+#if defined(JPEG_NO_SIMD)
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define JPEG_SSE2
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define JPEG_NEON
+#endif
+
+// zigzag position -> position in the block, padded in case of a bad run length
+static const uint8_t zigzag[64 + 16] =
+{
+     0,  1,  8, 16,  9,  2,  3, 10,
+    17, 24, 32, 25, 18, 11,  4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34,
+    27, 20, 13,  6,  7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36,
+    29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46,
+    53, 60, 61, 54, 47, 55, 62, 63,
+    63, 63, 63, 63, 63, 63, 63, 63,
+    63, 63, 63, 63, 63, 63, 63, 63
+};
+
+// the example tables from the JPEG spec (K.3), MJPEG frames often leave out DHT and expect these
+static const uint8_t defaultHuffTables[] =
+{
+    // luminance DC
+    0x00,
+    0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0,
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11,
+
+    // luminance AC
+    0x10,
+    0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7D,
+    0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+    0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xA1, 0x08, 0x23, 0x42, 0xB1, 0xC1, 0x15, 0x52, 0xD1, 0xF0,
+    0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0A, 0x16, 0x17, 0x18, 0x19, 0x1A, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2A, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+    0x4A, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5A, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+    0x6A, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7A, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+    0x8A, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9A, 0xA2, 0xA3, 0xA4, 0xA5, 0xA6, 0xA7,
+    0xA8, 0xA9, 0xAA, 0xB2, 0xB3, 0xB4, 0xB5, 0xB6, 0xB7, 0xB8, 0xB9, 0xBA, 0xC2, 0xC3, 0xC4, 0xC5,
+    0xC6, 0xC7, 0xC8, 0xC9, 0xCA, 0xD2, 0xD3, 0xD4, 0xD5, 0xD6, 0xD7, 0xD8, 0xD9, 0xDA, 0xE1, 0xE2,
+    0xE3, 0xE4, 0xE5, 0xE6, 0xE7, 0xE8, 0xE9, 0xEA, 0xF1, 0xF2, 0xF3, 0xF4, 0xF5, 0xF6, 0xF7, 0xF8,
+    0xF9, 0xFA,
+
+    // chrominance DC
+    0x01,
+    0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0,
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11,
+
+    // chrominance AC
+    0x11,
+    0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77,
+    0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+    0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xA1, 0xB1, 0xC1, 0x09, 0x23, 0x33, 0x52, 0xF0,
+    0x15, 0x62, 0x72, 0xD1, 0x0A, 0x16, 0x24, 0x34, 0xE1, 0x25, 0xF1, 0x17, 0x18, 0x19, 0x1A, 0x26,
+    0x27, 0x28, 0x29, 0x2A, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+    0x49, 0x4A, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5A, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6A, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7A, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+    0x88, 0x89, 0x8A, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9A, 0xA2, 0xA3, 0xA4, 0xA5,
+    0xA6, 0xA7, 0xA8, 0xA9, 0xAA, 0xB2, 0xB3, 0xB4, 0xB5, 0xB6, 0xB7, 0xB8, 0xB9, 0xBA, 0xC2, 0xC3,
+    0xC4, 0xC5, 0xC6, 0xC7, 0xC8, 0xC9, 0xCA, 0xD2, 0xD3, 0xD4, 0xD5, 0xD6, 0xD7, 0xD8, 0xD9, 0xDA,
+    0xE2, 0xE3, 0xE4, 0xE5, 0xE6, 0xE7, 0xE8, 0xE9, 0xEA, 0xF2, 0xF3, 0xF4, 0xF5, 0xF6, 0xF7, 0xF8,
+    0xF9, 0xFA
+};
+
+// IDCT constants, 12 fractional bits
+static constexpr int fix12(double x) {return int(x * 4096 + (x < 0 ? -0.5 : 0.5));}
+
+static constexpr int k0541 = fix12(0.541196100), k0765 = fix12(0.765366865), k1847 = fix12(1.847759065);
+static constexpr int k1175 = fix12(1.175875602), k0899 = fix12(0.899976223), k2562 = fix12(2.562915447);
+static constexpr int k1961 = fix12(1.961570560), k0390 = fix12(0.390180644);
+static constexpr int k0298 = fix12(0.298631336), k2053 = fix12(2.053119869), k3072 = fix12(3.072711026), k1501 = fix12(1.501321110);
+
+// the multiplies are grouped into pairs (a * c0 + b * c1) so that the SIMD versions can use multiply-add
+static constexpr int rot26a[2] = {k0541, k0541 - k1847};         // (s2, s6)
+static constexpr int rot26b[2] = {k0541 + k0765, k0541};
+static constexpr int rot1735a[2] = {k1175 - k0899, k1175};       // (s1 + s7, s3 + s5)
+static constexpr int rot1735b[2] = {k1175, k1175 - k2562};
+static constexpr int rot73a[2] = {k0298 - k1961, -k1961};        // (s7, s3)
+static constexpr int rot73b[2] = {-k1961, k3072 - k1961};
+static constexpr int rot51a[2] = {k2053 - k0390, -k0390};        // (s5, s1)
+static constexpr int rot51b[2] = {-k0390, k1501 - k0390};
+
+// first pass keeps 2 extra bits, second includes the +128 level shift
+static const int idctBias1 = 1 << 9, idctShift1 = 10;
+static const int idctBias2 = (1 << 16) + (128 << 17), idctShift2 = 17;
+
+// YCbCr -> RGB constants, 13 fractional bits
+static constexpr int fix13(double x) {return int(x * 8192 + 0.5);}
+
+static constexpr int crR = fix13(1.402), cbG = fix13(0.344136), crG = fix13(0.714136), cbB = fix13(1.772);
+
+static inline uint8_t clamp8(int v)
+{
+    return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+static inline int clamp16(int v)
+{
+    return v < -32768 ? -32768 : (v > 32767 ? 32767 : v);
+}
+
+static inline uint32_t read32BE(const uint8_t *p)
+{
+    return p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+// sign extend the extra bits of a coefficient
+static inline int extend(int v, int size)
+{
+    // negative values have a leading 0
+    if(v < (1 << (size - 1)))
+        v -= (1 << size) - 1;
+
+    return v;
+}
+
+#if defined(JPEG_SSE2)
+
+struct Wide
+{
+    __m128i lo, hi;
+};
+
+static inline Wide operator+(Wide a, Wide b) {return {_mm_add_epi32(a.lo, b.lo), _mm_add_epi32(a.hi, b.hi)};}
+static inline Wide operator-(Wide a, Wide b) {return {_mm_sub_epi32(a.lo, b.lo), _mm_sub_epi32(a.hi, b.hi)};}
+
+static inline __m128i pairConst(const int c[2])
+{
+    return _mm_set1_epi32((c[0] & 0xFFFF) | (uint32_t(c[1]) << 16));
+}
+
+// a * c[0] + b * c[1]
+static inline Wide rotate(__m128i a, __m128i b, const int c[2])
+{
+    auto k = pairConst(c);
+    return {_mm_madd_epi16(_mm_unpacklo_epi16(a, b), k), _mm_madd_epi16(_mm_unpackhi_epi16(a, b), k)};
+}
+
+// v << 12
+static inline Wide widen(__m128i v)
+{
+    auto zero = _mm_setzero_si128();
+    return {_mm_srai_epi32(_mm_unpacklo_epi16(zero, v), 4), _mm_srai_epi32(_mm_unpackhi_epi16(zero, v), 4)};
+}
+
+template<int shift>
+static inline __m128i narrow(Wide v)
+{
+    return _mm_packs_epi32(_mm_srai_epi32(v.lo, shift), _mm_srai_epi32(v.hi, shift));
+}
+
+template<int bias, int shift>
+static inline void idctPass(__m128i r[8])
+{
+    // even part
+    auto t2 = rotate(r[2], r[6], rot26a);
+    auto t3 = rotate(r[2], r[6], rot26b);
+    auto t0 = widen(_mm_adds_epi16(r[0], r[4]));
+    auto t1 = widen(_mm_subs_epi16(r[0], r[4]));
+
+    Wide b = {_mm_set1_epi32(bias), _mm_set1_epi32(bias)};
+    auto x0 = t0 + t3 + b, x3 = t0 - t3 + b;
+    auto x1 = t1 + t2 + b, x2 = t1 - t2 + b;
+
+    // odd part
+    auto sum17 = _mm_adds_epi16(r[1], r[7]), sum35 = _mm_adds_epi16(r[3], r[5]);
+    auto y4 = rotate(sum17, sum35, rot1735a);
+    auto y5 = rotate(sum17, sum35, rot1735b);
+    auto y0 = rotate(r[7], r[3], rot73a);
+    auto y2 = rotate(r[7], r[3], rot73b);
+    auto y1 = rotate(r[5], r[1], rot51a);
+    auto y3 = rotate(r[5], r[1], rot51b);
+
+    auto o0 = y0 + y4, o1 = y1 + y5, o2 = y2 + y5, o3 = y3 + y4;
+
+    r[0] = narrow<shift>(x0 + o3);
+    r[7] = narrow<shift>(x0 - o3);
+    r[1] = narrow<shift>(x1 + o2);
+    r[6] = narrow<shift>(x1 - o2);
+    r[2] = narrow<shift>(x2 + o1);
+    r[5] = narrow<shift>(x2 - o1);
+    r[3] = narrow<shift>(x3 + o0);
+    r[4] = narrow<shift>(x3 - o0);
+}
+
+static inline void transpose(__m128i r[8])
+{
+    auto a0 = _mm_unpacklo_epi16(r[0], r[1]), a1 = _mm_unpackhi_epi16(r[0], r[1]);
+    auto a2 = _mm_unpacklo_epi16(r[2], r[3]), a3 = _mm_unpackhi_epi16(r[2], r[3]);
+    auto a4 = _mm_unpacklo_epi16(r[4], r[5]), a5 = _mm_unpackhi_epi16(r[4], r[5]);
+    auto a6 = _mm_unpacklo_epi16(r[6], r[7]), a7 = _mm_unpackhi_epi16(r[6], r[7]);
+
+    auto b0 = _mm_unpacklo_epi32(a0, a2), b1 = _mm_unpackhi_epi32(a0, a2);
+    auto b2 = _mm_unpacklo_epi32(a1, a3), b3 = _mm_unpackhi_epi32(a1, a3);
+    auto b4 = _mm_unpacklo_epi32(a4, a6), b5 = _mm_unpackhi_epi32(a4, a6);
+    auto b6 = _mm_unpacklo_epi32(a5, a7), b7 = _mm_unpackhi_epi32(a5, a7);
+
+    r[0] = _mm_unpacklo_epi64(b0, b4); r[1] = _mm_unpackhi_epi64(b0, b4);
+    r[2] = _mm_unpacklo_epi64(b1, b5); r[3] = _mm_unpackhi_epi64(b1, b5);
+    r[4] = _mm_unpacklo_epi64(b2, b6); r[5] = _mm_unpackhi_epi64(b2, b6);
+    r[6] = _mm_unpacklo_epi64(b3, b7); r[7] = _mm_unpackhi_epi64(b3, b7);
+}
+
+static void idctBlock(const int16_t *coeffs, uint8_t *out, int stride)
+{
+    __m128i r[8];
+    for(int i = 0; i < 8; i++)
+        r[i] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(coeffs + i * 8));
+
+    idctPass<idctBias1, idctShift1>(r);
+    transpose(r);
+    idctPass<idctBias2, idctShift2>(r);
+    transpose(r);
+
+    for(int i = 0; i < 8; i += 2)
+    {
+        auto p = _mm_packus_epi16(r[i], r[i + 1]);
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(out + i * stride), p);
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(out + (i + 1) * stride), _mm_srli_si128(p, 8));
+    }
+}
+
+#elif defined(JPEG_NEON)
+
+struct Wide
+{
+    int32x4_t lo, hi;
+};
+
+static inline Wide operator+(Wide a, Wide b) {return {vaddq_s32(a.lo, b.lo), vaddq_s32(a.hi, b.hi)};}
+static inline Wide operator-(Wide a, Wide b) {return {vsubq_s32(a.lo, b.lo), vsubq_s32(a.hi, b.hi)};}
+
+// a * c[0] + b * c[1]
+static inline Wide rotate(int16x8_t a, int16x8_t b, const int c[2])
+{
+    return {vmlal_n_s16(vmull_n_s16(vget_low_s16(a), c[0]), vget_low_s16(b), c[1]),
+            vmlal_n_s16(vmull_n_s16(vget_high_s16(a), c[0]), vget_high_s16(b), c[1])};
+}
+
+// v << 12
+static inline Wide widen(int16x8_t v)
+{
+    return {vshll_n_s16(vget_low_s16(v), 12), vshll_n_s16(vget_high_s16(v), 12)};
+}
+
+template<int shift>
+static inline int16x8_t narrow(Wide v)
+{
+    return vcombine_s16(vqmovn_s32(vshrq_n_s32(v.lo, shift)), vqmovn_s32(vshrq_n_s32(v.hi, shift)));
+}
+
+template<int bias, int shift>
+static inline void idctPass(int16x8_t r[8])
+{
+    // even part
+    auto t2 = rotate(r[2], r[6], rot26a);
+    auto t3 = rotate(r[2], r[6], rot26b);
+    auto t0 = widen(vqaddq_s16(r[0], r[4]));
+    auto t1 = widen(vqsubq_s16(r[0], r[4]));
+
+    Wide b = {vdupq_n_s32(bias), vdupq_n_s32(bias)};
+    auto x0 = t0 + t3 + b, x3 = t0 - t3 + b;
+    auto x1 = t1 + t2 + b, x2 = t1 - t2 + b;
+
+    // odd part
+    auto sum17 = vqaddq_s16(r[1], r[7]), sum35 = vqaddq_s16(r[3], r[5]);
+    auto y4 = rotate(sum17, sum35, rot1735a);
+    auto y5 = rotate(sum17, sum35, rot1735b);
+    auto y0 = rotate(r[7], r[3], rot73a);
+    auto y2 = rotate(r[7], r[3], rot73b);
+    auto y1 = rotate(r[5], r[1], rot51a);
+    auto y3 = rotate(r[5], r[1], rot51b);
+
+    auto o0 = y0 + y4, o1 = y1 + y5, o2 = y2 + y5, o3 = y3 + y4;
+
+    r[0] = narrow<shift>(x0 + o3);
+    r[7] = narrow<shift>(x0 - o3);
+    r[1] = narrow<shift>(x1 + o2);
+    r[6] = narrow<shift>(x1 - o2);
+    r[2] = narrow<shift>(x2 + o1);
+    r[5] = narrow<shift>(x2 - o1);
+    r[3] = narrow<shift>(x3 + o0);
+    r[4] = narrow<shift>(x3 - o0);
+}
+
+static inline void transpose(int16x8_t r[8])
+{
+    auto t01 = vtrnq_s16(r[0], r[1]), t23 = vtrnq_s16(r[2], r[3]);
+    auto t45 = vtrnq_s16(r[4], r[5]), t67 = vtrnq_s16(r[6], r[7]);
+
+    auto u0 = vtrnq_s32(vreinterpretq_s32_s16(t01.val[0]), vreinterpretq_s32_s16(t23.val[0]));
+    auto u1 = vtrnq_s32(vreinterpretq_s32_s16(t01.val[1]), vreinterpretq_s32_s16(t23.val[1]));
+    auto u2 = vtrnq_s32(vreinterpretq_s32_s16(t45.val[0]), vreinterpretq_s32_s16(t67.val[0]));
+    auto u3 = vtrnq_s32(vreinterpretq_s32_s16(t45.val[1]), vreinterpretq_s32_s16(t67.val[1]));
+
+    auto combineLow = [](int32x4_t a, int32x4_t b) {return vreinterpretq_s16_s32(vcombine_s32(vget_low_s32(a), vget_low_s32(b)));};
+    auto combineHigh = [](int32x4_t a, int32x4_t b) {return vreinterpretq_s16_s32(vcombine_s32(vget_high_s32(a), vget_high_s32(b)));};
+
+    r[0] = combineLow(u0.val[0], u2.val[0]); r[4] = combineHigh(u0.val[0], u2.val[0]);
+    r[1] = combineLow(u1.val[0], u3.val[0]); r[5] = combineHigh(u1.val[0], u3.val[0]);
+    r[2] = combineLow(u0.val[1], u2.val[1]); r[6] = combineHigh(u0.val[1], u2.val[1]);
+    r[3] = combineLow(u1.val[1], u3.val[1]); r[7] = combineHigh(u1.val[1], u3.val[1]);
+}
+
+static void idctBlock(const int16_t *coeffs, uint8_t *out, int stride)
+{
+    int16x8_t r[8];
+    for(int i = 0; i < 8; i++)
+        r[i] = vld1q_s16(coeffs + i * 8);
+
+    idctPass<idctBias1, idctShift1>(r);
+    transpose(r);
+    idctPass<idctBias2, idctShift2>(r);
+    transpose(r);
+
+    for(int i = 0; i < 8; i++)
+        vst1_u8(out + i * stride, vqmovun_s16(r[i]));
+}
+
+#else
+
+// same steps as the SIMD versions, so the output matches
+// (including saturating the 16-bit sums)
+static inline void idct1D(const int *s, int bias, int shift, int *out)
+{
+    // even part
+    int t2 = s[2] * rot26a[0] + s[6] * rot26a[1];
+    int t3 = s[2] * rot26b[0] + s[6] * rot26b[1];
+    int t0 = clamp16(s[0] + s[4]) * 4096;
+    int t1 = clamp16(s[0] - s[4]) * 4096;
+
+    int x0 = t0 + t3 + bias, x3 = t0 - t3 + bias;
+    int x1 = t1 + t2 + bias, x2 = t1 - t2 + bias;
+
+    // odd part
+    int sum17 = clamp16(s[1] + s[7]), sum35 = clamp16(s[3] + s[5]);
+    int y4 = sum17 * rot1735a[0] + sum35 * rot1735a[1];
+    int y5 = sum17 * rot1735b[0] + sum35 * rot1735b[1];
+    int y0 = s[7] * rot73a[0] + s[3] * rot73a[1];
+    int y2 = s[7] * rot73b[0] + s[3] * rot73b[1];
+    int y1 = s[5] * rot51a[0] + s[1] * rot51a[1];
+    int y3 = s[5] * rot51b[0] + s[1] * rot51b[1];
+
+    int o0 = y0 + y4, o1 = y1 + y5, o2 = y2 + y5, o3 = y3 + y4;
+
+    out[0] = (x0 + o3) >> shift;
+    out[7] = (x0 - o3) >> shift;
+    out[1] = (x1 + o2) >> shift;
+    out[6] = (x1 - o2) >> shift;
+    out[2] = (x2 + o1) >> shift;
+    out[5] = (x2 - o1) >> shift;
+    out[3] = (x3 + o0) >> shift;
+    out[4] = (x3 - o0) >> shift;
+}
+
+static void idctBlock(const int16_t *coeffs, uint8_t *out, int stride)
+{
+    int tmp[64], s[8], o[8];
+
+    // columns
+    for(int x = 0; x < 8; x++)
+    {
+        auto col = coeffs + x;
+
+        if(!col[8] && !col[16] && !col[24] && !col[32] && !col[40] && !col[48] && !col[56])
+        {
+            // DC only
+            for(int y = 0; y < 8; y++)
+                tmp[y * 8 + x] = clamp16(col[0] * 4);
+            continue;
+        }
+
+        for(int u = 0; u < 8; u++)
+            s[u] = col[u * 8];
+
+        idct1D(s, idctBias1, idctShift1, o);
+
+        for(int y = 0; y < 8; y++)
+            tmp[y * 8 + x] = clamp16(o[y]);
+    }
+
+    // rows
+    for(int y = 0; y < 8; y++, out += stride)
+    {
+        idct1D(tmp + y * 8, idctBias2, idctShift2, o);
+
+        for(int x = 0; x < 8; x++)
+            out[x] = clamp8(o[x]);
+    }
+}
+
+#endif
+
+// reduced size IDCTs for scaled decoding, these only use the low frequency coefficients
+// 1/2 C(u) cos((2x + 1) u pi / 2N), 12 fractional bits
+static const int idct4Matrix[4 * 4] =
+{
+    1448,  1892,  1448,   784,
+    1448,   784, -1448, -1892,
+    1448,  -784, -1448,  1892,
+    1448, -1892,  1448,  -784
+};
+
+static const int idct2Matrix[2 * 2] =
+{
+    1448,  1448,
+    1448, -1448
+};
+
+template<int n>
+static void idctBlockReduced(const int16_t *coeffs, uint8_t *out, int stride)
+{
+    auto matrix = n == 4 ? idct4Matrix : idct2Matrix;
+    int tmp[n * n];
+
+    // columns, keeping 1 extra bit
+    for(int x = 0; x < n; x++)
+    {
+        for(int y = 0; y < n; y++)
+        {
+            int sum = 0;
+            for(int v = 0; v < n; v++)
+                sum += matrix[y * n + v] * coeffs[v * 8 + x];
+
+            tmp[y * n + x] = (sum + (1 << 10)) >> 11;
+        }
+    }
+
+    // rows
+    for(int y = 0; y < n; y++, out += stride)
+    {
+        for(int x = 0; x < n; x++)
+        {
+            int sum = 0;
+            for(int u = 0; u < n; u++)
+                sum += matrix[x * n + u] * tmp[y * n + u];
+
+            out[x] = clamp8((sum + (1 << 12) + (128 << 13)) >> 13);
+        }
+    }
+}
+
+static void idctBlockDC(const int16_t *coeffs, uint8_t *out, int)
+{
+    *out = clamp8(((coeffs[0] + 4) >> 3) + 128);
+}
+
+// by JPEGOutput::scale
+static void (*const idctFuncs[4])(const int16_t *, uint8_t *, int) =
+{
+    idctBlock, idctBlockReduced<4>, idctBlockReduced<2>, idctBlockDC
+};
+
+// chroma terms for the scalar conversion, same results as the SIMD multiplies
+struct ChromaLUT
+{
+    int16_t crR[256], cbG[256], crG[256], cbB[256];
+};
+
+static constexpr ChromaLUT makeChromaLUT()
+{
+    ChromaLUT lut{};
+
+    for(int i = 0; i < 256; i++)
+    {
+        int c = (i - 128) * 128;
+        lut.crR[i] = (c * crR) >> 16;
+        lut.cbG[i] = (c * cbG) >> 16;
+        lut.crG[i] = (c * crG) >> 16;
+        lut.cbB[i] = (c * cbB) >> 16;
+    }
+
+    return lut;
+}
+
+static constexpr ChromaLUT chromaLUT = makeChromaLUT();
+
+#if defined(JPEG_SSE2)
+// writes 16 pixels, as 4 bytes each so the byte after the last pixel is overwritten
+static inline void storeRGBX(uint8_t *out, __m128i r, __m128i g, __m128i b)
+{
+    auto zero = _mm_setzero_si128();
+    auto rg0 = _mm_unpacklo_epi8(r, g), rg1 = _mm_unpackhi_epi8(r, g);
+    auto bx0 = _mm_unpacklo_epi8(b, zero), bx1 = _mm_unpackhi_epi8(b, zero);
+
+    __m128i px[4] = {_mm_unpacklo_epi16(rg0, bx0), _mm_unpackhi_epi16(rg0, bx0), _mm_unpacklo_epi16(rg1, bx1), _mm_unpackhi_epi16(rg1, bx1)};
+
+    for(auto &p : px)
+    {
+        for(int j = 0; j < 4; j++, out += 3)
+        {
+            uint32_t v = _mm_cvtsi128_si32(p);
+            memcpy(out, &v, 4);
+            p = _mm_srli_si128(p, 4);
+        }
+    }
+}
+#endif
+
+// greyscale frames
+static void convertRowGrey(const uint8_t *y, const uint8_t *, const uint8_t *, uint8_t *out, int count)
+{
+    int i = 0;
+
+#if defined(JPEG_SSE2)
+    // leave at least one pixel for the scalar loop to overwrite the extra byte
+    for(; i + 16 < count; i += 16)
+    {
+        auto y8 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(y + i));
+        storeRGBX(out + i * 3, y8, y8, y8);
+    }
+#elif defined(JPEG_NEON)
+    for(; i + 16 <= count; i += 16)
+    {
+        auto y8 = vld1q_u8(y + i);
+        vst3q_u8(out + i * 3, uint8x16x3_t{{y8, y8, y8}});
+    }
+#endif
+
+    out += i * 3;
+
+    for(; i < count; i++, out += 3)
+        out[0] = out[1] = out[2] = y[i];
+}
+
+// one chroma sample for every chromaScale pixels horizontally, 4:4:4 and 4:4:0 are 1, 4:2:2 and 4:2:0 are 2
+// vertical subsampling is handled by picking the chroma row
+template<int chromaScale>
+static void convertRow(const uint8_t *y, const uint8_t *cb, const uint8_t *cr, uint8_t *out, int count)
+{
+    static_assert(chromaScale == 1 || chromaScale == 2);
+
+    int i = 0;
+
+#if defined(JPEG_SSE2)
+    auto zero = _mm_setzero_si128();
+    auto bias = _mm_set1_epi16(8), chromaOff = _mm_set1_epi16(128);
+    auto kCrR = _mm_set1_epi16(crR), kCbG = _mm_set1_epi16(cbG), kCrG = _mm_set1_epi16(crG), kCbB = _mm_set1_epi16(cbB);
+
+    auto convert = [&](__m128i y8, __m128i cb8, __m128i cr8, __m128i &r, __m128i &g, __m128i &b)
+    {
+        auto yy = _mm_add_epi16(_mm_slli_epi16(y8, 4), bias);
+        auto cbs = _mm_slli_epi16(_mm_sub_epi16(cb8, chromaOff), 7);
+        auto crs = _mm_slli_epi16(_mm_sub_epi16(cr8, chromaOff), 7);
+
+        r = _mm_srai_epi16(_mm_add_epi16(yy, _mm_mulhi_epi16(crs, kCrR)), 4);
+        g = _mm_srai_epi16(_mm_sub_epi16(_mm_sub_epi16(yy, _mm_mulhi_epi16(cbs, kCbG)), _mm_mulhi_epi16(crs, kCrG)), 4);
+        b = _mm_srai_epi16(_mm_add_epi16(yy, _mm_mulhi_epi16(cbs, kCbB)), 4);
+    };
+
+    // leave at least one pixel for the scalar loop to overwrite the extra byte
+    for(; i + 16 < count; i += 16)
+    {
+        auto y8 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(y + i));
+        __m128i cb8, cr8;
+
+        if constexpr(chromaScale == 2)
+        {
+            // duplicate each sample
+            cb8 = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(cb + i / 2));
+            cr8 = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(cr + i / 2));
+            cb8 = _mm_unpacklo_epi8(cb8, cb8);
+            cr8 = _mm_unpacklo_epi8(cr8, cr8);
+        }
+        else
+        {
+            cb8 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(cb + i));
+            cr8 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(cr + i));
+        }
+
+        __m128i r0, g0, b0, r1, g1, b1;
+        convert(_mm_unpacklo_epi8(y8, zero), _mm_unpacklo_epi8(cb8, zero), _mm_unpacklo_epi8(cr8, zero), r0, g0, b0);
+        convert(_mm_unpackhi_epi8(y8, zero), _mm_unpackhi_epi8(cb8, zero), _mm_unpackhi_epi8(cr8, zero), r1, g1, b1);
+
+        storeRGBX(out + i * 3, _mm_packus_epi16(r0, r1), _mm_packus_epi16(g0, g1), _mm_packus_epi16(b0, b1));
+    }
+#elif defined(JPEG_NEON)
+    auto chromaOff = vdupq_n_s16(128);
+
+    // (a * b) >> 16
+    auto mulHi = [](int16x8_t a, int16_t b)
+    {
+        return vcombine_s16(vshrn_n_s32(vmull_n_s16(vget_low_s16(a), b), 16), vshrn_n_s32(vmull_n_s16(vget_high_s16(a), b), 16));
+    };
+
+    auto convert = [&](uint8x8_t y8, uint8x8_t cb8, uint8x8_t cr8, uint8x8_t &r, uint8x8_t &g, uint8x8_t &b)
+    {
+        auto yy = vaddq_s16(vshlq_n_s16(vreinterpretq_s16_u16(vmovl_u8(y8)), 4), vdupq_n_s16(8));
+        auto cbs = vshlq_n_s16(vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(cb8)), chromaOff), 7);
+        auto crs = vshlq_n_s16(vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(cr8)), chromaOff), 7);
+
+        r = vqshrun_n_s16(vaddq_s16(yy, mulHi(crs, crR)), 4);
+        g = vqshrun_n_s16(vsubq_s16(vsubq_s16(yy, mulHi(cbs, cbG)), mulHi(crs, crG)), 4);
+        b = vqshrun_n_s16(vaddq_s16(yy, mulHi(cbs, cbB)), 4);
+    };
+
+    for(; i + 16 <= count; i += 16)
+    {
+        auto y8 = vld1q_u8(y + i);
+        uint8x16_t cb8, cr8;
+
+        if constexpr(chromaScale == 2)
+        {
+            // duplicate each sample
+            auto cb2 = vld1_u8(cb + i / 2), cr2 = vld1_u8(cr + i / 2);
+            auto cbz = vzip_u8(cb2, cb2), crz = vzip_u8(cr2, cr2);
+            cb8 = vcombine_u8(cbz.val[0], cbz.val[1]);
+            cr8 = vcombine_u8(crz.val[0], crz.val[1]);
+        }
+        else
+        {
+            cb8 = vld1q_u8(cb + i);
+            cr8 = vld1q_u8(cr + i);
+        }
+
+        uint8x8_t r0, g0, b0, r1, g1, b1;
+        convert(vget_low_u8(y8), vget_low_u8(cb8), vget_low_u8(cr8), r0, g0, b0);
+        convert(vget_high_u8(y8), vget_high_u8(cb8), vget_high_u8(cr8), r1, g1, b1);
+
+        uint8x16x3_t rgb;
+        rgb.val[0] = vcombine_u8(r0, r1);
+        rgb.val[1] = vcombine_u8(g0, g1);
+        rgb.val[2] = vcombine_u8(b0, b1);
+        vst3q_u8(out + i * 3, rgb);
+    }
+#endif
+
+    out += i * 3;
+
+    for(; i < count; i++)
+    {
+        int yy = (y[i] << 4) + 8;
+        int c = i / chromaScale;
+
+        *out++ = clamp8((yy + chromaLUT.crR[cr[c]]) >> 4);
+        *out++ = clamp8((yy - chromaLUT.cbG[cb[c]] - chromaLUT.crG[cr[c]]) >> 4);
+        *out++ = clamp8((yy + chromaLUT.cbB[cb[c]]) >> 4);
+    }
+}
+
+// paletted output, a 6x7x6 colour cube (green gets the extra level) or 256 greys for greyscale frames
+static constexpr int paletteLevels[3] = {6, 7, 6};
+static constexpr int paletteMult[3] = {42, 6, 1};
+static constexpr int paletteColours = 6 * 7 * 6;
+
+// 4x4 ordered dither
+static constexpr uint8_t bayer4[16] =
+{
+     0,  8,  2, 10,
+    12,  4, 14,  6,
+     3, 11,  1,  9,
+    15,  7, 13,  5
+};
+
+// covers the unclamped output of the colour conversion plus the dither offsets
+static constexpr int ditherBias = 288;
+
+struct DitherLUT
+{
+    uint8_t quant[3][ditherBias * 2 + 256]; // clamps and picks the level, already multiplied for the palette index
+    int16_t offset[3][16]; // by position in the dither pattern
+};
+
+static constexpr DitherLUT makeDitherLUT()
+{
+    DitherLUT lut{};
+
+    for(int c = 0; c < 3; c++)
+    {
+        int levels = paletteLevels[c] - 1;
+
+        for(int i = 0; i < ditherBias * 2 + 256; i++)
+        {
+            int v = std::min(std::max(i - ditherBias, 0), 255);
+            lut.quant[c][i] = (v * levels + 127) / 255 * paletteMult[c];
+        }
+
+        // +-half a level
+        for(int i = 0; i < 16; i++)
+            lut.offset[c][i] = (bayer4[i] * 2 + 1 - 16) * 255 / (32 * levels);
+    }
+
+    return lut;
+}
+
+static constexpr DitherLUT ditherLUT = makeDitherLUT();
+
+struct PaletteLUT
+{
+    uint8_t colour[256 * 3];
+    uint8_t grey[256 * 3];
+};
+
+static constexpr PaletteLUT makePaletteLUT()
+{
+    PaletteLUT lut{};
+
+    for(int i = 0; i < paletteColours; i++)
+    {
+        lut.colour[i * 3 + 0] = i / paletteMult[0] * 255 / (paletteLevels[0] - 1);
+        lut.colour[i * 3 + 1] = i / paletteMult[1] % paletteLevels[1] * 255 / (paletteLevels[1] - 1);
+        lut.colour[i * 3 + 2] = i % paletteLevels[2] * 255 / (paletteLevels[2] - 1);
+    }
+
+    for(int i = 0; i < 256; i++)
+        lut.grey[i * 3 + 0] = lut.grey[i * 3 + 1] = lut.grey[i * 3 + 2] = i;
+
+    return lut;
+}
+
+static constexpr PaletteLUT paletteLUT = makePaletteLUT();
+
+static inline uint8_t ditherPixel(int r, int g, int b, int d)
+{
+    return ditherLUT.quant[0][r + ditherBias + ditherLUT.offset[0][d]]
+         + ditherLUT.quant[1][g + ditherBias + ditherLUT.offset[1][d]]
+         + ditherLUT.quant[2][b + ditherBias + ditherLUT.offset[2][d]];
+}
+
+// greyscale frames use a grey palette, so no dithering needed
+static void convertRowGreyPaletted(const uint8_t *y, const uint8_t *, const uint8_t *, uint8_t *out, int count, int, int)
+{
+    memcpy(out, y, count);
+}
+
+// same as convertRow, but dithered straight to palette indices, x and row are the position in the dither pattern
+template<int chromaScale>
+static void convertRowPaletted(const uint8_t *y, const uint8_t *cb, const uint8_t *cr, uint8_t *out, int count, int x, int row)
+{
+    static_assert(chromaScale == 1 || chromaScale == 2);
+
+    auto pattern = (row & 3) * 4;
+
+    for(int i = 0; i < count; i++)
+    {
+        int yy = (y[i] << 4) + 8;
+        int c = i / chromaScale;
+
+        int r = (yy + chromaLUT.crR[cr[c]]) >> 4;
+        int g = (yy - chromaLUT.cbG[cb[c]] - chromaLUT.crG[cr[c]]) >> 4;
+        int b = (yy + chromaLUT.cbB[cb[c]]) >> 4;
+
+        out[i] = ditherPixel(r, g, b, pattern + ((x + i) & 3));
+    }
+}
+
+#ifdef HOST_BUILD
+// runs a batch of tasks on a few persistent threads, the calling thread works on them too
+class SlicePool
+{
+public:
+    SlicePool(int numThreads)
+    {
+        for(int i = 1; i < numThreads; i++)
+            threads.emplace_back(&SlicePool::worker, this);
+    }
+
+    ~SlicePool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit = true;
+        }
+        startCond.notify_all();
+
+        for(auto &thread : threads)
+            thread.join();
+    }
+
+    int getNumThreads() const {return threads.size() + 1;}
+
+    void run(int count, void (*func)(void *, int), void *ctx)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            this->func = func;
+            this->ctx = ctx;
+            this->count = count;
+            next = 0;
+            remaining = count;
+            generation++;
+        }
+        startCond.notify_all();
+
+        runTasks();
+
+        std::unique_lock<std::mutex> lock(mutex);
+        doneCond.wait(lock, [this]{return remaining == 0;});
+    }
+
+private:
+    void worker()
+    {
+        unsigned lastGeneration = 0;
+
+        while(true)
+        {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                startCond.wait(lock, [&]{return quit || generation != lastGeneration;});
+
+                if(quit)
+                    return;
+
+                lastGeneration = generation;
+            }
+
+            runTasks();
+        }
+    }
+
+    void runTasks()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        while(next < count)
+        {
+            int index = next++;
+
+            lock.unlock();
+            func(ctx, index);
+            lock.lock();
+
+            if(--remaining == 0)
+                doneCond.notify_all();
+        }
+    }
+
+    std::vector<std::thread> threads;
+
+    std::mutex mutex;
+    std::condition_variable startCond, doneCond;
+
+    void (*func)(void *, int) = nullptr;
+    void *ctx = nullptr;
+    int count = 0, next = 0, remaining = 0;
+    unsigned generation = 0;
+    bool quit = false;
+};
+#endif
+
+JPEGDecoder::JPEGDecoder()
+{
+}
+
+JPEGDecoder::~JPEGDecoder()
+{
+}
+
+void JPEGDecoder::setMaxThreads(int threads)
+{
+#ifdef HOST_BUILD
+    maxThreads = threads;
+#else
+    (void)threads;
+#endif
+}
+
+void JPEGDecoder::reset()
+{
+    for(auto &table : dcTables)
+        table.valid = false;
+    for(auto &table : acTables)
+        table.valid = false;
+
+    numRows = nextRow = 0;
+}
+
+bool JPEGDecoder::decode(const uint8_t *data, uint32_t len, const JPEGOutput &out)
+{
+    if(!begin(data, len, out))
+        return false;
+
+#ifdef HOST_BUILD
+    if(!decodeScanParallel(output, numRows))
+    {
+        // called from the frame pipeline's thread, so no stage profiling (the probes belong to the main thread)
+        decodeRows(slices[0], output, 0, numRows);
+    }
+
+    nextRow = numRows;
+#else
+    decodeStep(numRows);
+#endif
+
+    return true;
+}
+
+bool JPEGDecoder::begin(const uint8_t *data, uint32_t len, const JPEGOutput &out)
+{
+    this->data = ptr = data;
+    dataEnd = data + len;
+    numRows = nextRow = 0;
+
+    if(!parseHeaders())
+        return false;
+
+    output = out;
+    output.scale = std::min(std::max(out.scale, 0), 3);
+    output.expand = std::min(std::max(out.expand, 0), output.scale);
+
+    int expandScale = 1 << output.expand;
+    int outScale = output.scale - output.expand;
+
+    blockSize = 8 >> output.scale;
+    outWidth = (width + (1 << outScale) - 1) >> outScale;
+    outHeight = (height + (1 << outScale) - 1) >> outScale;
+
+    output.x = std::min(std::max(out.x, 0), outWidth);
+    output.y = std::min(std::max(out.y, 0), outHeight);
+    visibleWidth = std::max(std::min(outWidth - output.x, out.width), 0);
+    visibleHeight = std::max(std::min(outHeight - output.y, out.height), 0);
+
+    // scaled pixels covering the visible area
+    decodeX = output.x >> output.expand;
+    decodeY = output.y >> output.expand;
+    decodeWidth = (output.x + visibleWidth + expandScale - 1) / expandScale - decodeX;
+    decodeHeight = (output.y + visibleHeight + expandScale - 1) / expandScale - decodeY;
+
+    for(int i = 0; i < numComponents; i++)
+        components[i].stride = mcusX * components[i].h * blockSize;
+
+    mcuBlocks = 0;
+    for(int s = 0; s < numScanComponents; s++)
+        mcuBlocks += components[scanComponents[s]].h * components[scanComponents[s]].v;
+
+    int rowHeight = maxV * blockSize, colWidth = maxH * blockSize;
+    firstRow = decodeY / rowHeight;
+    firstCol = decodeX / colWidth;
+    endCol = std::min(mcusX, (decodeX + decodeWidth + colWidth - 1) / colWidth);
+
+    if(visibleWidth > 0 && visibleHeight > 0)
+        numRows = std::min(mcusY, (decodeY + decodeHeight + rowHeight - 1) / rowHeight);
+
+    if(slices.empty())
+        slices.resize(1);
+
+    initSlice(slices[0], ptr);
+
+    return true;
+}
+
+bool JPEGDecoder::decodeStep(int maxRows)
+{
+    int endRow = std::min(numRows, nextRow + maxRows);
+
+    profileStages = true;
+    decodeRows(slices[0], output, nextRow, endRow);
+    profileStages = false;
+
+    nextRow = endRow;
+
+    return nextRow == numRows;
+}
+
+const uint8_t *JPEGDecoder::getPalette(bool greyscale)
+{
+    return greyscale ? paletteLUT.grey : paletteLUT.colour;
+}
+
+void JPEGDecoder::ditherRow(const uint8_t *rgb, uint8_t *out, int count, int x, int y)
+{
+    auto pattern = (y & 3) * 4;
+
+    for(int i = 0; i < count; i++, rgb += 3)
+        out[i] = ditherPixel(rgb[0], rgb[1], rgb[2], pattern + ((x + i) & 3));
+}
+
+bool JPEGDecoder::parseHeaders()
+{
+    if(dataEnd - ptr < 4 || ptr[0] != 0xFF || ptr[1] != 0xD8)
+        return false;
+
+    auto p = ptr + 2;
+    bool haveFrame = false, haveHuffTables = false;
+
+    restartInterval = 0;
+
+    while(true)
+    {
+        // find the next marker, skipping any fill bytes
+        while(p < dataEnd && *p != 0xFF)
+            p++;
+        while(p < dataEnd && *p == 0xFF)
+            p++;
+
+        if(p >= dataEnd)
+            return false;
+
+        auto marker = *p++;
+
+        // no length
+        if(marker == 0x01 || (marker >= 0xD0 && marker <= 0xD8))
+            continue;
+
+        if(marker == 0xD9 || dataEnd - p < 2)
+            return false;
+
+        int segLen = (p[0] << 8) | p[1];
+        if(segLen < 2 || segLen > dataEnd - p)
+            return false;
+
+        auto seg = p + 2;
+        segLen -= 2;
+        p = seg + segLen;
+
+        switch(marker)
+        {
+            case 0xC0: // baseline
+            case 0xC1: // extended, but still huffman
+                if(!parseSOF(seg, segLen))
+                    return false;
+                haveFrame = true;
+                break;
+
+            case 0xC4:
+                if(!parseDHT(seg, segLen))
+                    return false;
+                haveHuffTables = true;
+                break;
+
+            case 0xDB:
+                if(!parseDQT(seg, segLen))
+                    return false;
+                break;
+
+            case 0xDD:
+                if(segLen < 2)
+                    return false;
+                restartInterval = (seg[0] << 8) | seg[1];
+                break;
+
+            case 0xDA:
+                // no DHT, use the defaults (which are usually already loaded)
+                if(!haveHuffTables)
+                    parseDHT(defaultHuffTables, sizeof(defaultHuffTables));
+
+                if(!haveFrame || !parseSOS(seg, segLen))
+                    return false;
+
+                ptr = p;
+                return true;
+
+            default:
+                // progressive, lossless, arithmetic...
+                if(marker >= 0xC2 && marker <= 0xCF)
+                    return false;
+                break;
+        }
+    }
+}
+
+bool JPEGDecoder::parseSOF(const uint8_t *p, int len)
+{
+    if(len < 6 || p[0] != 8)
+        return false;
+
+    height = (p[1] << 8) | p[2];
+    width = (p[3] << 8) | p[4];
+    numComponents = p[5];
+
+    if(!width || !height || (numComponents != 1 && numComponents != 3) || len < 6 + numComponents * 3)
+        return false;
+
+    maxH = maxV = 1;
+
+    for(int i = 0; i < numComponents; i++)
+    {
+        auto &comp = components[i];
+        comp.id = p[6 + i * 3];
+        comp.h = p[7 + i * 3] >> 4;
+        comp.v = p[7 + i * 3] & 0xF;
+        comp.quantTable = p[8 + i * 3];
+
+        if(comp.h < 1 || comp.h > 4 || comp.v < 1 || comp.v > 4 || comp.quantTable > 3)
+            return false;
+
+        // a single component scan has one block per MCU
+        if(numComponents == 1)
+            comp.h = comp.v = 1;
+
+        maxH = std::max(maxH, int(comp.h));
+        maxV = std::max(maxV, int(comp.v));
+    }
+
+    for(int i = 0; i < numComponents; i++)
+    {
+        if(maxH % components[i].h || maxV % components[i].v)
+            return false;
+    }
+
+    mcusX = (width + maxH * 8 - 1) / (maxH * 8);
+    mcusY = (height + maxV * 8 - 1) / (maxV * 8);
+
+    // pick the colour conversion for the subsampling, anything unusual is upsampled first
+    chromaScale = 1;
+    upsampleChroma = false;
+
+    if(numComponents == 1)
+    {
+        convertFunc = convertRowGrey;
+        convertPalettedFunc = convertRowGreyPaletted;
+    }
+    else if(components[1].h == components[2].h && maxH / components[1].h <= 2)
+    {
+        chromaScale = maxH / components[1].h;
+        convertFunc = chromaScale == 2 ? convertRow<2> : convertRow<1>;
+        convertPalettedFunc = chromaScale == 2 ? convertRowPaletted<2> : convertRowPaletted<1>;
+    }
+    else
+    {
+        upsampleChroma = true;
+        convertFunc = convertRow<1>;
+        convertPalettedFunc = convertRowPaletted<1>;
+    }
+
+    return true;
+}
+
+bool JPEGDecoder::parseDHT(const uint8_t *p, int len)
+{
+    while(len > 0)
+    {
+        if(len < 17)
+            return false;
+
+        int tableClass = p[0] >> 4, id = p[0] & 0xF;
+
+        if(tableClass > 1 || id > 3)
+            return false;
+
+        int total = 0;
+        for(int i = 0; i < 16; i++)
+            total += p[1 + i];
+
+        if(total > 256 || len < 17 + total)
+            return false;
+
+        if(!buildHuffTable(tableClass ? acTables[id] : dcTables[id], p + 1, p + 17, tableClass ? acLUTs[id] : nullptr))
+            return false;
+
+        p += 17 + total;
+        len -= 17 + total;
+    }
+
+    return true;
+}
+
+bool JPEGDecoder::parseDQT(const uint8_t *p, int len)
+{
+    while(len > 0)
+    {
+        int precision = p[0] >> 4, id = p[0] & 0xF;
+
+        if(precision > 1 || id > 3)
+            return false;
+
+        int size = 1 + 64 * (precision + 1);
+        if(len < size)
+            return false;
+
+        for(int i = 0; i < 64; i++)
+            quantTables[id][i] = precision ? (p[1 + i * 2] << 8) | p[2 + i * 2] : p[1 + i];
+
+        p += size;
+        len -= size;
+    }
+
+    return true;
+}
+
+bool JPEGDecoder::parseSOS(const uint8_t *p, int len)
+{
+    if(len < 1)
+        return false;
+
+    numScanComponents = p[0];
+
+    // only single scan images
+    if(numScanComponents != numComponents || len < 1 + numScanComponents * 2 + 3)
+        return false;
+
+    for(int i = 0; i < numScanComponents; i++)
+    {
+        int id = p[1 + i * 2];
+        int tables = p[2 + i * 2];
+
+        int c = 0;
+        while(c < numComponents && components[c].id != id)
+            c++;
+
+        if(c == numComponents)
+            return false;
+
+        auto &comp = components[c];
+        comp.dcTable = tables >> 4;
+        comp.acTable = tables & 0xF;
+
+        if(comp.dcTable > 3 || comp.acTable > 3 || !dcTables[comp.dcTable].valid || !acTables[comp.acTable].valid)
+            return false;
+
+        scanComponents[i] = c;
+    }
+
+    return true;
+}
+
+bool JPEGDecoder::buildHuffTable(HuffTable &table, const uint8_t *counts, const uint8_t *symbols, uint32_t *acLUT)
+{
+    int total = 0;
+    for(int i = 0; i < 16; i++)
+        total += counts[i];
+
+    // most encoders write the same tables in every frame
+    if(table.valid && memcmp(table.counts, counts, 16) == 0 && memcmp(table.symbols, symbols, total) == 0)
+        return true;
+
+    table.valid = false;
+    memcpy(table.counts, counts, 16);
+    memset(table.fastLen, 0, sizeof(table.fastLen));
+
+    int code = 0, k = 0;
+
+    for(int len = 1; len <= 16; len++)
+    {
+        table.valOffset[len] = k - code;
+
+        for(int i = 0; i < counts[len - 1]; i++, k++, code++)
+        {
+            // too many codes for this length
+            if(code >= (1 << len))
+                return false;
+
+            table.symbols[k] = symbols[k];
+
+            // fill every entry that starts with this code
+            if(len <= fastBits)
+            {
+                int first = code << (fastBits - len), num = 1 << (fastBits - len);
+                for(int j = 0; j < num; j++)
+                {
+                    table.fastLen[first + j] = len;
+                    table.fastSym[first + j] = symbols[k];
+                }
+            }
+        }
+
+        table.maxCode[len] = counts[len - 1] ? code - 1 : -1;
+        code <<= 1;
+    }
+
+    if(acLUT)
+        buildACLUT(table, acLUT);
+
+    table.valid = true;
+    return true;
+}
+
+// decode a code from the top of an avail bit value
+int JPEGDecoder::lutDecode(const HuffTable &table, int bits, int avail, int &len)
+{
+    for(len = 1; len <= avail; len++)
+    {
+        int code = bits >> (avail - len);
+
+        if(code <= table.maxCode[len])
+            return table.symbols[code + table.valOffset[len]];
+    }
+
+    return -1;
+}
+
+void JPEGDecoder::buildACLUT(const HuffTable &table, uint32_t *lut)
+{
+    // each entry decodes as many (up to two) complete coefficients as fit in the looked up bits, plus a following EOB
+    for(int i = 0; i < (1 << acLUTBits); i++)
+    {
+        int used = 0, count = 0;
+        bool eob = false;
+        uint32_t entry = 0;
+
+        while(count < 2)
+        {
+            int avail = acLUTBits - used;
+            int bits = i & ((1 << avail) - 1);
+
+            int len;
+            int rs = lutDecode(table, bits, avail, len);
+
+            if(rs < 0)
+                break;
+
+            if(rs == 0)
+            {
+                used += len;
+                eob = true;
+                break;
+            }
+
+            int run = rs >> 4, size = rs & 0xF;
+
+            // doesn't fit, or the value is too big for the second slot
+            // (size 0 is only valid for a run of 16 zeros, which is stored as a run of 15 and a zero)
+            if(len + size > avail || (count == 1 && size > 5) || (size == 0 && run != 15))
+                break;
+
+            int val = size ? extend((bits >> (avail - len - size)) & ((1 << size) - 1), size) : 0;
+
+            if(count == 0)
+                entry |= run << 8 | (val & 0x3FF) << 12;
+            else
+                entry |= run << 22 | uint32_t(val & 0x3F) << 26;
+
+            used += len + size;
+            count++;
+        }
+
+        if(count || eob)
+            entry |= used | count << 5 | (eob ? 0x80 : 0);
+
+        lut[i] = entry;
+    }
+}
+
+#ifdef HOST_BUILD
+bool JPEGDecoder::decodeScanParallel(const JPEGOutput &out, int numRows)
+{
+    // need restart markers to start anywhere other than the beginning
+    if(!restartInterval || numRows - firstRow < 2)
+        return false;
+
+    int numThreads = maxThreads ? maxThreads : std::min(int(std::thread::hardware_concurrency()), 8);
+
+    if(numThreads < 2)
+        return false;
+
+    // find the data after each marker
+    restartMarkers.clear();
+
+    auto p = ptr;
+    while(p + 1 < dataEnd)
+    {
+        p = (const uint8_t *)memchr(p, 0xFF, dataEnd - p - 1);
+
+        if(!p)
+            break;
+
+        if(p[1] >= 0xD0 && p[1] <= 0xD7)
+        {
+            restartMarkers.push_back(p + 2);
+            p += 2;
+        }
+        else if(p[1] == 0) // stuffed byte
+            p += 2;
+        else if(p[1] == 0xFF) // fill byte
+            p++;
+        else // EOI or something unexpected
+            break;
+    }
+
+    // skip as many rows above the output as the markers allow
+    int startRow = firstRow;
+    while(startRow && ((startRow * mcusX) % restartInterval || size_t(startRow * mcusX / restartInterval) > restartMarkers.size()))
+        startRow--;
+
+    // split at rows that begin a restart interval
+    int targetRows = (numRows - startRow + numThreads - 1) / numThreads;
+
+    sliceRows.clear();
+    sliceRows.push_back(startRow);
+
+    for(int row = startRow + 1; row < numRows; row++)
+    {
+        int mcu = row * mcusX;
+
+        if(mcu % restartInterval)
+            continue;
+
+        if(size_t(mcu / restartInterval) > restartMarkers.size())
+            break;
+
+        if(row - sliceRows.back() >= targetRows)
+            sliceRows.push_back(row);
+    }
+
+    sliceRows.push_back(numRows);
+
+    int numSlices = sliceRows.size() - 1;
+
+    if(numSlices < 2)
+        return false;
+
+    if(!pool || pool->getNumThreads() != numThreads)
+    {
+        pool.reset();
+        pool.reset(new SlicePool(numThreads));
+    }
+
+    if(slices.size() < size_t(numSlices))
+        slices.resize(numSlices);
+
+    sliceOut = &out;
+    pool->run(numSlices, decodeSliceTask, this);
+
+    return true;
+}
+
+void JPEGDecoder::decodeSliceTask(void *ctx, int index)
+{
+    auto decoder = reinterpret_cast<JPEGDecoder *>(ctx);
+
+    int startRow = decoder->sliceRows[index];
+    int interval = startRow * decoder->mcusX / decoder->restartInterval;
+
+    auto &slice = decoder->slices[index];
+    decoder->initSlice(slice, interval ? decoder->restartMarkers[interval - 1] : decoder->ptr);
+    decoder->decodeRows(slice, *decoder->sliceOut, startRow, decoder->sliceRows[index + 1]);
+}
+#endif
+
+void JPEGDecoder::initSlice(Slice &slice, const uint8_t *start)
+{
+    // buffers for one row of MCUs, only the visible part needs coefficients
+    size_t coeffSize = (endCol - firstCol) * mcuBlocks * 64, planeSize = 0;
+    for(int i = 0; i < numComponents; i++)
+        planeSize += components[i].stride * components[i].v * blockSize;
+
+    if(slice.coeffBuf.size() < coeffSize)
+        slice.coeffBuf.resize(coeffSize);
+
+    if(slice.planeBuf.size() < planeSize)
+        slice.planeBuf.resize(planeSize);
+
+    auto plane = slice.planeBuf.data();
+    for(int i = 0; i < numComponents; i++)
+    {
+        slice.planes[i] = plane;
+        plane += components[i].stride * components[i].v * blockSize;
+    }
+
+    size_t upsampleSize = mcusX * maxH * 8 * 2;
+    if(upsampleChroma && slice.upsampleBuf.size() < upsampleSize)
+        slice.upsampleBuf.resize(upsampleSize);
+
+    if(output.expand && slice.expandBuf.size() < size_t(decodeWidth * 3))
+        slice.expandBuf.resize(decodeWidth * 3);
+
+    // reset the bit reader
+    slice.ptr = start;
+    slice.end = dataEnd;
+    slice.bitBuf = 0;
+    slice.bitCount = 0;
+    slice.hitMarker = false;
+    slice.error = false;
+
+    for(auto &pred : slice.dcPred)
+        pred = 0;
+
+    slice.restartsLeft = restartInterval;
+}
+
+void JPEGDecoder::decodeRows(Slice &slice, const JPEGOutput &out, int startRow, int endRow)
+{
+    auto idct = idctFuncs[out.scale];
+
+#ifdef PROFILER
+    uint32_t entropyUs = 0, idctUs = 0, colourUs = 0;
+#endif
+
+    for(int mcuY = startRow; mcuY < endRow; mcuY++)
+    {
+#ifdef PROFILER
+        if(profileStages)
+            profilerVidEntropyProbe->start();
+#endif
+        // entropy decode the whole row, only keeping the blocks covering the output
+        bool visibleRow = mcuY >= firstRow;
+        auto coeffs = slice.coeffBuf.data();
+
+        if(visibleRow)
+            memset(coeffs, 0, (endCol - firstCol) * mcuBlocks * 64 * sizeof(int16_t));
+
+        for(int mcuX = 0; mcuX < mcusX; mcuX++)
+        {
+            if(restartInterval)
+            {
+                if(!slice.restartsLeft)
+                {
+                    handleRestart(slice);
+                    slice.restartsLeft = restartInterval;
+                }
+                slice.restartsLeft--;
+            }
+
+            bool visible = visibleRow && mcuX >= firstCol && mcuX < endCol;
+
+            for(int s = 0; s < numScanComponents; s++)
+            {
+                auto &comp = components[scanComponents[s]];
+
+                for(int b = 0; b < comp.h * comp.v; b++)
+                {
+                    if(!visible)
+                    {
+                        if(!slice.error)
+                            decodeBlock<false>(slice, scanComponents[s], nullptr);
+
+                        continue;
+                    }
+
+                    // leave the rest of the interval blank after an error
+                    if(!slice.error && !decodeBlock<true>(slice, scanComponents[s], coeffs))
+                        memset(coeffs, 0, 64 * sizeof(int16_t));
+
+                    coeffs += 64;
+                }
+            }
+        }
+
+#ifdef PROFILER
+        if(profileStages)
+        {
+            entropyUs += profilerVidEntropyProbe->elapsed_us();
+            profilerVidIDCTProbe->start();
+        }
+#endif
+
+        // rows above the output are only needed for the DC predictions and bit position
+        if(!visibleRow)
+            continue;
+
+        coeffs = slice.coeffBuf.data();
+
+        for(int mcuX = firstCol; mcuX < endCol; mcuX++)
+        {
+            for(int s = 0; s < numScanComponents; s++)
+            {
+                auto &comp = components[scanComponents[s]];
+                auto plane = slice.planes[scanComponents[s]];
+
+                for(int by = 0; by < comp.v; by++)
+                {
+                    for(int bx = 0; bx < comp.h; bx++, coeffs += 64)
+                        idct(coeffs, plane + by * blockSize * comp.stride + (mcuX * comp.h + bx) * blockSize, comp.stride);
+                }
+            }
+        }
+
+#ifdef PROFILER
+        if(profileStages)
+        {
+            idctUs += profilerVidIDCTProbe->elapsed_us();
+            profilerVidColourProbe->start();
+        }
+#endif
+
+        outputRows(slice, out, mcuY);
+
+#ifdef PROFILER
+        if(profileStages)
+            colourUs += profilerVidColourProbe->elapsed_us();
+#endif
+    }
+
+#ifdef PROFILER
+    if(profileStages)
+    {
+        profilerVidEntropyProbe->store_elapsed_us(entropyUs);
+        profilerVidIDCTProbe->store_elapsed_us(idctUs);
+        profilerVidColourProbe->store_elapsed_us(colourUs);
+    }
+#endif
+}
+
+template<bool output>
+bool JPEGDecoder::decodeBlock(Slice &slice, int comp, int16_t *coeffs)
+{
+    auto &component = components[comp];
+    auto &quant = quantTables[component.quantTable];
+
+    // DC
+    slice.refillBits();
+
+    int t = slice.decodeHuff(dcTables[component.dcTable]);
+    if(t > 11)
+        slice.error = true;
+
+    if(slice.error)
+        return false;
+
+    slice.dcPred[comp] += t ? extend(slice.getBits(t), t) : 0;
+
+    if constexpr(output)
+        coeffs[0] = slice.dcPred[comp] * quant[0];
+
+    // AC
+    auto &acTable = acTables[component.acTable];
+    auto acLUT = acLUTs[component.acTable];
+
+    for(int k = 1; k < 64;)
+    {
+        slice.refillBits();
+
+        auto entry = acLUT[slice.bitBuf >> (64 - acLUTBits)];
+        int run = (entry >> 8) & 0xF;
+
+        // fast path, unless the first coefficient is the last in the block and the entry continues into the next one
+        if((entry & 0x1F) && !(k + run >= 63 && (entry & 0xE0) != 0x20))
+        {
+            slice.consumeBits(entry & 0x1F);
+
+            int count = (entry >> 5) & 3;
+
+            if(count)
+            {
+                k += run;
+                if(k > 63)
+                {
+                    slice.error = true;
+                    break;
+                }
+
+                if constexpr(output)
+                    coeffs[zigzag[k]] = (int32_t(entry << 10) >> 22) * quant[k];
+                k++;
+
+                if(count == 2)
+                {
+                    k += (entry >> 22) & 0xF;
+                    if(k > 63)
+                    {
+                        slice.error = true;
+                        break;
+                    }
+
+                    if constexpr(output)
+                        coeffs[zigzag[k]] = (int32_t(entry) >> 26) * quant[k];
+                    k++;
+                }
+            }
+
+            // EOB
+            if(entry & 0x80)
+                break;
+
+            continue;
+        }
+
+        int rs = slice.decodeHuff(acTable);
+        int size = rs & 0xF;
+        run = rs >> 4;
+
+        if(!size)
+        {
+            // end of block
+            if(run != 15)
+                break;
+
+            k += 16;
+            continue;
+        }
+
+        k += run;
+        if(k > 63)
+        {
+            slice.error = true;
+            break;
+        }
+
+        if constexpr(output)
+            coeffs[zigzag[k]] = extend(slice.getBits(size), size) * quant[k];
+        else
+            slice.getBits(size);
+        k++;
+    }
+
+    return !slice.error;
+}
+
+void JPEGDecoder::outputRows(Slice &slice, const JPEGOutput &out, int mcuY)
+{
+    int expandScale = 1 << out.expand;
+    int y = mcuY * maxV * blockSize;
+    int startRow = std::max(decodeY - y, 0);
+    int endRow = std::min(maxV * blockSize, decodeY + decodeHeight - y);
+    int w = decodeWidth;
+
+    for(int row = startRow; row < endRow; row++)
+    {
+        auto yRow = slice.planes[0] + row * components[0].stride + decodeX;
+        auto rgb = expandScale > 1 ? slice.expandBuf.data() : out.data + (y + row - decodeY) * out.stride;
+
+        if(numComponents == 1)
+        {
+            if(out.paletted)
+                convertPalettedFunc(yRow, nullptr, nullptr, rgb, w, decodeX, y + row);
+            else
+                convertFunc(yRow, nullptr, nullptr, rgb, w);
+        }
+        else
+        {
+            const uint8_t *chroma[2];
+
+            for(int c = 0; c < 2; c++)
+            {
+                auto &comp = components[c + 1];
+                auto src = slice.planes[c + 1] + (row * comp.v / maxV) * comp.stride;
+
+                if(!upsampleChroma)
+                {
+                    chroma[c] = src + decodeX / chromaScale;
+                    continue;
+                }
+
+                // the output may start part way through a chroma sample
+                auto up = slice.upsampleBuf.data() + c * (slice.upsampleBuf.size() / 2);
+                int scale = maxH / comp.h;
+                int i = decodeX % scale;
+                src += decodeX / scale;
+
+                for(int x = 0; x < w; src++, i = 0)
+                {
+                    for(; i < scale && x < w; i++)
+                        up[x++] = *src;
+                }
+
+                chroma[c] = up;
+            }
+
+            // starting on the second half of a chroma sample
+            int start = 0;
+            if(!upsampleChroma && decodeX % chromaScale)
+            {
+                if(out.paletted)
+                    convertRowPaletted<1>(yRow, chroma[0], chroma[1], rgb, 1, decodeX, y + row);
+                else
+                    convertRow<1>(yRow, chroma[0], chroma[1], rgb, 1);
+
+                start = 1;
+            }
+
+            if(out.paletted)
+                convertPalettedFunc(yRow + start, chroma[0] + start, chroma[1] + start, rgb + start, w - start, decodeX + start, y + row);
+            else
+                convertFunc(yRow + start, chroma[0] + start, chroma[1] + start, rgb + start * 3, w - start);
+        }
+
+        if(expandScale > 1)
+            expandRow(rgb, out, y + row);
+    }
+}
+
+// repeats each pixel of a scaled row to fill the output rows it covers
+void JPEGDecoder::expandRow(const uint8_t *rgb, const JPEGOutput &out, int row)
+{
+    int scale = 1 << out.expand;
+    int startY = std::max(row * scale - out.y, 0);
+    int endY = std::min((row + 1) * scale - out.y, visibleHeight);
+
+    if(startY >= endY)
+        return;
+
+    int w = visibleWidth;
+    auto dst = out.data + startY * out.stride;
+    auto p = dst;
+
+    if(out.paletted)
+    {
+        for(int x = 0, i = out.x & (scale - 1); x < w; rgb++, i = 0)
+        {
+            for(; i < scale && x < w; i++, x++)
+                *p++ = *rgb;
+        }
+    }
+    else
+    {
+        for(int x = 0, i = out.x & (scale - 1); x < w; rgb += 3, i = 0)
+        {
+            for(; i < scale && x < w; i++, x++, p += 3)
+            {
+                p[0] = rgb[0];
+                p[1] = rgb[1];
+                p[2] = rgb[2];
+            }
+        }
+    }
+
+    int rowLen = w * (out.paletted ? 1 : 3);
+    for(int y = startY + 1; y < endY; y++)
+        memcpy(out.data + y * out.stride, dst, rowLen);
+}
+
+void JPEGDecoder::handleRestart(Slice &slice)
+{
+    slice.bitBuf = 0;
+    slice.bitCount = 0;
+    slice.hitMarker = false;
+
+    for(auto &pred : slice.dcPred)
+        pred = 0;
+
+    // should be right at the marker, but search in case the data was bad
+    auto &p = slice.ptr;
+
+    while(p + 1 < slice.end)
+    {
+        if(p[0] == 0xFF && p[1] >= 0xD0 && p[1] <= 0xD7)
+        {
+            p += 2;
+            slice.error = false;
+            return;
+        }
+        p++;
+    }
+}
+
+inline void JPEGDecoder::Slice::refillBits()
+{
+    if(bitCount > 32)
+        return;
+
+    // take 32 bits at once if there are no 0xFF bytes to deal with
+    if(end - ptr >= 4)
+    {
+        uint32_t word = read32BE(ptr), inv = ~word;
+
+        if(!((inv - 0x01010101) & ~inv & 0x80808080))
+        {
+            bitBuf |= uint64_t(word) << (32 - bitCount);
+            bitCount += 32;
+            ptr += 4;
+            return;
+        }
+    }
+
+    fillBits();
+}
+
+void JPEGDecoder::Slice::fillBits()
+{
+    while(bitCount <= 56)
+    {
+        uint64_t byte = 0;
+
+        // pad with zeros after a marker or the end of the data
+        if(!hitMarker && ptr < end)
+        {
+            byte = *ptr;
+
+            if(byte != 0xFF)
+                ptr++;
+            else if(ptr + 1 < end && ptr[1] == 0)
+                ptr += 2; // stuffed byte
+            else
+            {
+                hitMarker = true;
+                byte = 0;
+            }
+        }
+
+        bitBuf |= byte << (56 - bitCount);
+        bitCount += 8;
+    }
+}
+
+inline void JPEGDecoder::Slice::consumeBits(int n)
+{
+    bitBuf <<= n;
+    bitCount -= n;
+}
+
+int JPEGDecoder::Slice::getBits(int n)
+{
+    if(bitCount < n)
+        refillBits();
+
+    int v = bitBuf >> (64 - n);
+    consumeBits(n);
+
+    return v;
+}
+
+// assumes at least 32 bits are buffered
+int JPEGDecoder::Slice::decodeHuff(const HuffTable &table)
+{
+    int look = bitBuf >> (64 - fastBits);
+    int len = table.fastLen[look];
+
+    if(len)
+    {
+        consumeBits(len);
+        return table.fastSym[look];
+    }
+
+    for(len = fastBits + 1; len <= 16; len++)
+    {
+        int code = bitBuf >> (64 - len);
+
+        if(code <= table.maxCode[len])
+        {
+            consumeBits(len);
+            return table.symbols[code + table.valOffset[len]];
+        }
+    }
+
+    error = true;
+    return 0;
+}
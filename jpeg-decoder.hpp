@@ -0,0 +1,185 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// where decoded pixels go, anything outside width/height is dropped
+struct JPEGOutput
+{
+    uint8_t *data;
+    int stride; // bytes per row
+    int width, height;
+
+    int scale = 0; // decode at 1 / (1 << scale) of the frame size, up to 3
+    int expand = 0; // repeat scaled pixels (1 << expand) times, up to scale
+
+    int x = 0, y = 0; // position of the output in the frame, after scaling
+
+    bool paletted = false; // one byte per pixel, indices into JPEGDecoder::getPalette
+};
+
+class SlicePool;
+
+// baseline JPEG decoder for MJPEG frames, outputs RGB888 or dithered palette indices
+// keeps its buffers between frames so decoding doesn't allocate unless the frame size changes
+class JPEGDecoder
+{
+public:
+    JPEGDecoder();
+    ~JPEGDecoder();
+
+    // forget any tables from the last file
+    void reset();
+
+    // frames with restart markers are split across this many threads (host builds only), 0 picks from the number of cores
+    void setMaxThreads(int threads);
+
+    // returns false if the frame isn't baseline JPEG (or is broken before the scan data)
+    bool decode(const uint8_t *data, uint32_t len, const JPEGOutput &out);
+
+    // same as decode, but only parses the headers, the data and output must stay valid until decodeStep has finished the frame
+    bool begin(const uint8_t *data, uint32_t len, const JPEGOutput &out);
+    // decodes up to maxRows more rows of MCUs, returns true once the frame is finished
+    bool decodeStep(int maxRows);
+    bool isDecoding() const {return nextRow < numRows;}
+
+    // size of the frame, after scaling
+    int getWidth() const {return outWidth;}
+    int getHeight() const {return outHeight;}
+
+    // size of the part of the frame that was output
+    int getVisibleWidth() const {return visibleWidth;}
+    int getVisibleHeight() const {return visibleHeight;}
+
+    bool isGreyscale() const {return numComponents == 1;}
+
+    // 256 RGB entries for paletted output
+    static const uint8_t *getPalette(bool greyscale);
+    // converts RGB888 to the colour palette, x and y are the position on screen to keep the dither pattern in place
+    static void ditherRow(const uint8_t *rgb, uint8_t *out, int count, int x, int y);
+
+private:
+    static const int fastBits = 9;
+    static const int acLUTBits = 10;
+
+    struct HuffTable
+    {
+        bool valid = false;
+        uint8_t counts[16]; // as in the DHT segment, to check for changes
+        uint8_t fastLen[1 << fastBits]; // 0 if the code is longer than fastBits
+        uint8_t fastSym[1 << fastBits];
+        int32_t maxCode[17];
+        int32_t valOffset[17];
+        uint8_t symbols[256];
+    };
+    struct Component
+    {
+        uint8_t id;
+        uint8_t h, v;
+        uint8_t quantTable;
+        uint8_t dcTable, acTable;
+
+        int stride; // of the sample rows
+    };
+
+    // decoding state for a range of MCU rows, frames with restart markers can be split into several
+    struct Slice
+    {
+        // bit reader
+        const uint8_t *ptr, *end;
+        uint64_t bitBuf;
+        int bitCount;
+        bool hitMarker;
+        bool error;
+
+        int dcPred[3];
+        int restartsLeft;
+
+        std::vector<int16_t> coeffBuf; // one MCU row
+        std::vector<uint8_t> planeBuf; // samples for one MCU row
+        std::vector<uint8_t> upsampleBuf;
+        std::vector<uint8_t> expandBuf; // one row before expanding
+        uint8_t *planes[3];
+
+        void refillBits();
+        void fillBits();
+        void consumeBits(int n);
+        int getBits(int n);
+        int decodeHuff(const HuffTable &table);
+    };
+
+    bool parseHeaders();
+    bool parseSOF(const uint8_t *ptr, int len);
+    bool parseDHT(const uint8_t *ptr, int len);
+    bool parseDQT(const uint8_t *ptr, int len);
+    bool parseSOS(const uint8_t *ptr, int len);
+    static bool buildHuffTable(HuffTable &table, const uint8_t *counts, const uint8_t *symbols, uint32_t *acLUT);
+    static void buildACLUT(const HuffTable &table, uint32_t *lut);
+    static int lutDecode(const HuffTable &table, int bits, int avail, int &len);
+
+    void initSlice(Slice &slice, const uint8_t *start);
+    void decodeRows(Slice &slice, const JPEGOutput &out, int startRow, int endRow);
+    // blocks outside the output only need decoding for the DC prediction and bit position, so output can be false to skip storing coefficients
+    template<bool output>
+    bool decodeBlock(Slice &slice, int comp, int16_t *coeffs);
+    void outputRows(Slice &slice, const JPEGOutput &out, int mcuY);
+    void expandRow(const uint8_t *rgb, const JPEGOutput &out, int row);
+    void handleRestart(Slice &slice);
+
+#ifdef HOST_BUILD
+    bool decodeScanParallel(const JPEGOutput &out, int numRows);
+    static void decodeSliceTask(void *ctx, int index);
+#endif
+
+    // input
+    const uint8_t *data = nullptr, *dataEnd = nullptr;
+    const uint8_t *ptr = nullptr; // start of the scan data after parsing
+
+    // tables
+    HuffTable dcTables[4], acTables[4];
+    uint32_t acLUTs[4][1 << acLUTBits]; // multiple symbols + extra bits per lookup
+    uint16_t quantTables[4][64]; // zigzag order
+    uint16_t restartInterval = 0;
+
+    // frame
+    int width = 0, height = 0;
+    int numComponents = 0;
+    Component components[3];
+    int maxH = 1, maxV = 1;
+    int mcusX = 0, mcusY = 0;
+
+    // colour conversion for the subsampling
+    void (*convertFunc)(const uint8_t *y, const uint8_t *cb, const uint8_t *cr, uint8_t *out, int count) = nullptr;
+    void (*convertPalettedFunc)(const uint8_t *y, const uint8_t *cb, const uint8_t *cr, uint8_t *out, int count, int x, int row) = nullptr;
+    int chromaScale = 1; // horizontal
+    bool upsampleChroma = false; // to full width before converting
+
+    // scan
+    int scanComponents[3];
+    int numScanComponents = 0;
+    int mcuBlocks = 0;
+
+    // progress through the frame
+    JPEGOutput output;
+    int blockSize = 8; // after scaling
+    int outWidth = 0, outHeight = 0;
+    int visibleWidth = 0, visibleHeight = 0; // of the frame inside the output
+    int decodeX = 0, decodeY = 0;
+    int decodeWidth = 0, decodeHeight = 0; // scaled pixels needed to fill the output
+    int firstRow = 0, firstCol = 0, endCol = 0; // MCUs covering the output, anything else is only entropy decoded
+    int numRows = 0, nextRow = 0;
+
+    std::vector<Slice> slices;
+    bool profileStages = false;
+
+#ifdef HOST_BUILD
+    // parallel decoding
+    std::unique_ptr<SlicePool> pool;
+    int maxThreads = 0;
+
+    std::vector<const uint8_t *> restartMarkers; // data after each marker
+    std::vector<int> sliceRows; // first row of each slice, and the end
+    const JPEGOutput *sliceOut = nullptr;
+#endif
+};
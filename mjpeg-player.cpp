@@ -15,7 +15,11 @@ blit::ProfilerProbe *profilerUpdateProbe;
 blit::ProfilerProbe *profilerRenderProbe;
 blit::ProfilerProbe *profilerVidReadProbe;
 blit::ProfilerProbe *profilerVidDecProbe;
+blit::ProfilerProbe *profilerVidEntropyProbe;
+blit::ProfilerProbe *profilerVidIDCTProbe;
+blit::ProfilerProbe *profilerVidColourProbe;
 blit::ProfilerProbe *profilerAudReadProbe;
+blit::ProfilerProbe *profilerIdxLoadProbe;
 #endif
 
 /*
@@ -36,6 +40,7 @@ std::string fileToLoad;
 bool renderedLoadMessage = false;
 
 AVIFile avi;
+const int panSpeed = 4; // pixels per update
 
 void openFile(std::string filename)
 {
@@ -44,13 +49,27 @@ void openFile(std::string filename)
    fileToLoad = filename;
 }
 
+// loading a video can switch to lores
+void screenModeChanged()
+{
+#ifdef PROFILER
+    profiler.set_display_size(blit::screen.bounds.w, blit::screen.bounds.h);
+#endif
+}
+
+void showBrowser()
+{
+    blit::set_screen_mode(blit::ScreenMode::hires);
+    screenModeChanged();
+}
+
 void init()
 {
     blit::set_screen_mode(blit::ScreenMode::hires);
 
 #ifdef PROFILER
     profiler.set_display_size(blit::screen.bounds.w, blit::screen.bounds.h);
-    profiler.set_rows(5);
+    profiler.set_rows(9);
     profiler.set_alpha(200);
     profiler.display_history(true);
 
@@ -63,7 +82,11 @@ void init()
     profilerUpdateProbe = profiler.add_probe("Update", 300);
     profilerVidReadProbe = profiler.add_probe("JPEG Read", 300);
     profilerVidDecProbe = profiler.add_probe("JPEG Decode", 300);
+    profilerVidEntropyProbe = profiler.add_probe("JPEG Entropy", 300);
+    profilerVidIDCTProbe = profiler.add_probe("JPEG IDCT", 300);
+    profilerVidColourProbe = profiler.add_probe("JPEG Colour", 300);
     profilerAudReadProbe = profiler.add_probe("Audio Read", 300);
+    profilerIdxLoadProbe = profiler.add_probe("Index Load", 300);
 #endif
 
     fileBrowser.set_extensions({".avi"});
@@ -91,7 +114,10 @@ void render(uint32_t time_ms)
 
     blit::screen.alpha = 0xFF;
     blit::screen.pen = blit::Pen(20, 30, 40);
-    blit::screen.clear();
+
+    // the video may have been decoded straight into the screen, let it clear what it needs
+    if(!avi.getPlaying() || !fileToLoad.empty())
+        blit::screen.clear();
 
     if(!fileToLoad.empty())
     {
@@ -128,7 +154,33 @@ void update(uint32_t time_ms)
     {
         // b released
         if(blit::buttons.released & blit::Button::B)
+        {
             avi.stop();
+            showBrowser();
+        }
+
+        // a toggles between scaling big videos down and showing them full size
+        if(blit::buttons.released & blit::Button::A)
+            avi.setCropped(!avi.getCropped());
+
+        // x toggles the 8-bit paletted screen mode
+        if(blit::buttons.released & blit::Button::X)
+        {
+            avi.setPaletted(!avi.getPaletted());
+            screenModeChanged();
+        }
+
+        int panX = 0, panY = 0;
+        if(blit::buttons & blit::Button::DPAD_LEFT)
+            panX -= panSpeed;
+        if(blit::buttons & blit::Button::DPAD_RIGHT)
+            panX += panSpeed;
+        if(blit::buttons & blit::Button::DPAD_UP)
+            panY -= panSpeed;
+        if(blit::buttons & blit::Button::DPAD_DOWN)
+            panY += panSpeed;
+
+        avi.pan(panX, panY);
 
         avi.update(time_ms);
     }
@@ -139,7 +191,12 @@ void update(uint32_t time_ms)
     if(!fileToLoad.empty() && renderedLoadMessage)
     {
         if(avi.load(fileToLoad))
+        {
+            screenModeChanged();
             avi.play(0);
+        }
+        else
+            showBrowser();
         fileToLoad = "";
     }
 }
@@ -0,0 +1,160 @@
+#include "offset-table.hpp"
+
+// values are encoded as:
+// 0xxxxxxx                        - 7 bits
+// 10xxxxxx xxxxxxxx               - 14 bits
+// 110xxxxx xxxxxxxx xxxxxxxx      - 21 bits
+// 11100000 + 4 bytes              - anything else
+//
+// entries are an offset delta in 2-byte units (chunks are aligned), followed by the change in size from the previous entry (zigzag)
+// an unaligned offset delta is stored as 11100001 + 4 bytes
+
+static const uint8_t unalignedMarker = 0xE1;
+
+void OffsetTable::clear()
+{
+    count = 0;
+    lastOffset = lastSize = 0;
+    data.clear();
+}
+
+void OffsetTable::reserve(uint32_t numEntries)
+{
+    // two bytes of offset and one or two of size is typical
+    data.reserve(numEntries * 3);
+}
+
+void OffsetTable::push_back(uint32_t offset, uint32_t size)
+{
+    auto delta = offset - lastOffset;
+
+    if(delta & 1)
+    {
+        data.push_back(unalignedMarker);
+        data.push_back(delta);
+        data.push_back(delta >> 8);
+        data.push_back(delta >> 16);
+        data.push_back(delta >> 24);
+    }
+    else
+        writeValue(delta / 2);
+
+    auto sizeDelta = int32_t(size - lastSize);
+    writeValue(uint32_t(sizeDelta) << 1 ^ uint32_t(sizeDelta >> 31));
+
+    lastOffset = offset;
+    lastSize = size;
+    count++;
+}
+
+void OffsetTable::readNext(uint32_t &pos, uint32_t &offset, uint32_t &size) const
+{
+    auto p = data.data() + pos;
+
+    if(*p == unalignedMarker)
+    {
+        offset += p[1] | p[2] << 8 | p[3] << 16 | uint32_t(p[4]) << 24;
+        p += 5;
+    }
+    else
+        offset += readValue(p) * 2;
+
+    auto sizeDelta = readValue(p);
+    size += (sizeDelta >> 1) ^ -(sizeDelta & 1);
+
+    pos = p - data.data();
+}
+
+uint32_t OffsetTable::load(blit::File &file, uint32_t offset)
+{
+    SavedHeader head;
+    if(file.read(offset, sizeof(head), reinterpret_cast<char *>(&head)) != sizeof(head))
+        return 0;
+
+    // check the length before allocating anything, the header could be from a broken file
+    uint32_t fileLeft = file.get_length() - offset - sizeof(head);
+
+    if(head.dataLen > uint64_t(head.count) * maxEntryLen || head.dataLen > fileLeft)
+        return 0;
+
+    count = head.count;
+    lastOffset = head.lastOffset;
+    lastSize = head.lastSize;
+
+    offset += sizeof(head);
+
+    data.resize(head.dataLen);
+    if(file.read(offset, head.dataLen, reinterpret_cast<char *>(data.data())) != int32_t(head.dataLen))
+        return 0;
+
+    return sizeof(head) + head.dataLen;
+}
+
+uint32_t OffsetTable::save(blit::File &file, uint32_t offset) const
+{
+    SavedHeader head;
+    head.count = count;
+    head.lastOffset = lastOffset;
+    head.lastSize = lastSize;
+    head.dataLen = data.size();
+
+    file.write(offset, sizeof(head), reinterpret_cast<const char *>(&head));
+    offset += sizeof(head);
+
+    file.write(offset, head.dataLen, reinterpret_cast<const char *>(data.data()));
+
+    return sizeof(head) + head.dataLen;
+}
+
+void OffsetTable::writeValue(uint32_t val)
+{
+    if(val >= 1 << 21)
+    {
+        data.push_back(0xE0);
+        data.push_back(val);
+        data.push_back(val >> 8);
+        data.push_back(val >> 16);
+        data.push_back(val >> 24);
+    }
+    else if(val >= 1 << 14)
+    {
+        data.push_back(0xC0 | val >> 16);
+        data.push_back(val >> 8);
+        data.push_back(val);
+    }
+    else if(val >= 1 << 7)
+    {
+        data.push_back(0x80 | val >> 8);
+        data.push_back(val);
+    }
+    else
+        data.push_back(val);
+}
+
+uint32_t OffsetTable::readValue(const uint8_t *&p) const
+{
+    uint32_t ret;
+
+    if(p[0] < 0x80)
+    {
+        ret = p[0];
+        p++;
+    }
+    else if(p[0] < 0xC0)
+    {
+        ret = (p[0] & 0x3F) << 8 | p[1];
+        p += 2;
+    }
+    else if(p[0] < 0xE0)
+    {
+        ret = (p[0] & 0x1F) << 16 | p[1] << 8 | p[2];
+        p += 3;
+    }
+    else
+    {
+        ret = p[1] | p[2] << 8 | p[3] << 16 | uint32_t(p[4]) << 24;
+        p += 5;
+    }
+
+    return ret;
+}
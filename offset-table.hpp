@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "engine/file.hpp"
+
+// compact list of chunk offsets and sizes
+// stored as variable length deltas from the previous entry, read back in order
+class OffsetTable
+{
+public:
+    void clear();
+    void reserve(uint32_t numEntries);
+
+    void push_back(uint32_t offset, uint32_t size);
+
+    uint32_t size() const {return count;}
+    bool empty() const {return count == 0;}
+
+    // sequential access, pos is the position in the encoded data
+    // offset and size should be the previous entry (or 0 for the first)
+    void readNext(uint32_t &pos, uint32_t &offset, uint32_t &size) const;
+
+    // returns the number of bytes read/written, 0 on failure
+    uint32_t load(blit::File &file, uint32_t offset);
+    uint32_t save(blit::File &file, uint32_t offset) const;
+
+private:
+    struct SavedHeader
+    {
+        uint32_t count;
+        uint32_t lastOffset, lastSize;
+        uint32_t dataLen;
+    };
+
+    static const int maxEntryLen = 10; // 5 bytes each for the offset and size
+
+    void writeValue(uint32_t val);
+    uint32_t readValue(const uint8_t *&p) const;
+
+    uint32_t count = 0;
+    uint32_t lastOffset = 0, lastSize = 0;
+
+    std::vector<uint8_t> data;
+};
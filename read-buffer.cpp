@@ -0,0 +1,79 @@
+#include <algorithm>
+#include <cstring>
+
+#include "read-buffer.hpp"
+
+ReadBuffer::~ReadBuffer()
+{
+    delete[] data;
+}
+
+void ReadBuffer::init(blit::File &file, uint32_t size, uint32_t endOffset)
+{
+    this->file = &file;
+
+    if(size != this->size)
+    {
+        delete[] data;
+        data = new uint8_t[size];
+        this->size = size;
+    }
+
+    start = end = 0;
+    fileEnd = endOffset;
+}
+
+int32_t ReadBuffer::read(uint32_t offset, uint32_t len, char *buf)
+{
+    // outside the window
+    if(!data || offset < start || offset + len > start + size || offset + len > fileEnd)
+        return file->read(offset, len, buf);
+
+    if(offset + len > end)
+    {
+        fill(offset + len);
+
+        // read failed
+        if(offset + len > end)
+            return file->read(offset, len, buf);
+    }
+
+    // copy out, may wrap around
+    auto pos = offset % size;
+    auto firstLen = std::min(len, size - pos);
+
+    memcpy(buf, data + pos, firstLen);
+    memcpy(buf + firstLen, data, len - firstLen);
+
+    return len;
+}
+
+void ReadBuffer::discard(uint32_t offset)
+{
+    if(offset <= start)
+        return;
+
+    start = offset;
+
+    if(end < start)
+        end = start;
+}
+
+void ReadBuffer::fill(uint32_t needEnd)
+{
+    // read at least fillSize, limited by the free space
+    auto newEnd = std::max(needEnd, end + fillSize);
+    newEnd = std::min({newEnd, start + size, fileEnd});
+
+    while(end < newEnd)
+    {
+        auto pos = end % size;
+        auto len = std::min(newEnd - end, size - pos);
+
+        auto read = file->read(end, len, reinterpret_cast<char *>(data + pos));
+        if(read <= 0)
+            break;
+
+        end += read;
+    }
+}
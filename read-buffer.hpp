@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstdint>
+
+#include "engine/file.hpp"
+
+// read-ahead ring buffer for mostly sequential reads
+// reads inside the buffered window are served from memory and the window is extended with large reads,
+// anything outside it is read directly
+class ReadBuffer
+{
+public:
+    ~ReadBuffer();
+
+    void init(blit::File &file, uint32_t size, uint32_t endOffset);
+
+    int32_t read(uint32_t offset, uint32_t len, char *buf);
+
+    // data before offset is no longer needed
+    void discard(uint32_t offset);
+
+private:
+    void fill(uint32_t needEnd);
+
+    static const uint32_t fillSize = 16 * 1024;
+
+    blit::File *file = nullptr;
+
+    uint8_t *data = nullptr;
+    uint32_t size = 0;
+
+    uint32_t start = 0, end = 0; // buffered range
+    uint32_t fileEnd = 0;
+};